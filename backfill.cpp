@@ -0,0 +1,92 @@
+#include "backfill.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <signal.h>
+#include <string>
+#include <vector>
+
+#include "status_manager.hpp"
+
+namespace tsp {
+
+bool backfill_allows(const std::string &uuid,
+                     const std::vector<waiting_job> &waiting,
+                     const std::vector<running_alloc> &running,
+                     int32_t total_slots, int64_t mem_budget, int64_t at,
+                     const std::function<bool(const waiting_job &)>
+                         &placeable) {
+  // A waiting job whose tsp instance was SIGKILLed can't hold anything up
+  auto alive = [](const waiting_job &w) {
+    return kill(static_cast<pid_t>(w.pid), 0) == 0 || errno == EPERM;
+  };
+  auto free_slots = total_slots;
+  auto free_mem = mem_budget;
+  for (const auto &r : running) {
+    free_slots -= r.slots;
+    free_mem -= r.mem;
+  }
+  auto head = std::find_if(waiting.begin(), waiting.end(), alive);
+  auto me = std::find_if(waiting.begin(), waiting.end(),
+                         [&](const waiting_job &w) { return w.uuid == uuid; });
+  if (me != waiting.end() && me->mem > free_mem) {
+    return false;
+  }
+  if (head == waiting.end() || me == waiting.end() || me <= head) {
+    return true;
+  }
+
+  if (std::any_of(head, me, [&](const waiting_job &w) {
+        return w.slots <= free_slots && w.mem <= free_mem && alive(w) &&
+               placeable(w);
+      })) {
+    // Someone ahead of us can take these slots
+    return false;
+  }
+
+  // Walk forward through expected job ends until the head job would fit
+  constexpr auto never = std::numeric_limits<int64_t>::max();
+  struct job_end {
+    int64_t time;
+    int32_t slots;
+    int64_t mem;
+  };
+  std::vector<job_end> ends;
+  for (const auto &r : running) {
+    auto end = never;
+    if (r.est_time) {
+      end = std::max(r.stime.value_or(at) + r.est_time.value(), at);
+    }
+    ends.push_back({end, r.slots, r.mem});
+  }
+  std::sort(ends.begin(), ends.end(),
+            [](const job_end &a, const job_end &b) { return a.time < b.time; });
+  auto shadow = never;
+  auto shadow_free = free_slots;
+  auto shadow_mem = free_mem;
+  auto head_fits = [&]() {
+    return shadow_free >= head->slots && shadow_mem >= head->mem;
+  };
+  for (const auto &e : ends) {
+    if (head_fits() || e.time == never) {
+      break;
+    }
+    shadow_free += e.slots;
+    shadow_mem += e.mem;
+    shadow = e.time;
+  }
+  if (!head_fits()) {
+    // Can't tell when the reservation starts, so nothing may jump ahead
+    return false;
+  }
+  if (me->slots <= shadow_free - head->slots &&
+      me->mem <= shadow_mem - head->mem) {
+    return true;
+  }
+  return me->est_time && at + me->est_time.value() <= shadow;
+}
+
+} // namespace tsp
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "status_manager.hpp"
+
+namespace tsp {
+
+// EASY backfill. waiting is in priority order. A job may not start while
+// a job ahead of it could use the free slots. The first waiting job holds
+// a reservation for the slots it needs at the earliest time running jobs
+// are expected to free them. Any other job may start now only if it
+// leaves that reservation intact, either by finishing before it begins or
+// by using slots it doesn't need. Jobs without an estimate are assumed to
+// run forever. Reserved memory is treated the same way as slots, against
+// a budget of mem_budget bytes, and no job may start without enough free
+// memory. A job ahead only holds us back if placeable says the free slots
+// could actually be allocated to it now, so one whose SMT or distribution
+// policy can't be met doesn't block everything behind it.
+bool backfill_allows(const std::string &uuid,
+                     const std::vector<waiting_job> &waiting,
+                     const std::vector<running_alloc> &running,
+                     int32_t total_slots, int64_t mem_budget, int64_t at,
+                     const std::function<bool(const waiting_job &)> &placeable);
+
+} // namespace tsp
@@ -0,0 +1,164 @@
+#include "cgroup.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tsp {
+
+namespace {
+
+std::string read_file(const std::filesystem::path &fn) {
+  std::ifstream in(fn);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+// Controllers have to be enabled in the parent before a child cgroup gets
+// their interface files. Each is enabled on its own so one that can't be
+// doesn't stop the others, e.g. a root with processes of its own can't
+// enable cpuset or memory. Returns the controllers that are enabled.
+std::set<std::string> enable_controllers(const std::filesystem::path &root) {
+  auto available = std::stringstream{read_file(root / "cgroup.controllers")};
+  auto enabled = std::stringstream{read_file(root / "cgroup.subtree_control")};
+  std::set<std::string> wanted{"cpuset", "memory", "cpu", "io"};
+  std::set<std::string> out;
+  std::string controller;
+  while (enabled >> controller) {
+    wanted.erase(controller);
+    out.insert(controller);
+  }
+  while (available >> controller) {
+    if (!wanted.contains(controller)) {
+      continue;
+    }
+    auto fd = open((root / "cgroup.subtree_control").c_str(),
+                   O_WRONLY | O_CLOEXEC);
+    auto val = "+" + controller;
+    if (fd == -1 || write(fd, val.data(), val.size()) == -1) {
+      std::cerr << std::format("Unable to enable the {} controller in {}: {}",
+                               controller, root.string(), strerror(errno))
+                << std::endl;
+    } else {
+      out.insert(controller);
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  return out;
+}
+
+} // namespace
+
+Job_cgroup::Job_cgroup(const std::string &uuid) : procs_fd_(-1) {
+  auto root = std::getenv(cgroup_root_env.data());
+  if (root == nullptr || *root == '\0') {
+    return;
+  }
+  if (!std::filesystem::exists(std::filesystem::path{root} /
+                               "cgroup.controllers")) {
+    std::cerr << std::format("{}={} is not a cgroup v2 directory, jobs will "
+                             "only be bound with hwloc",
+                             cgroup_root_env, root)
+              << std::endl;
+    return;
+  }
+  // Binding and memory limits can't be enforced without these
+  auto enabled = enable_controllers(root);
+  for (const auto controller : {"cpuset", "memory"}) {
+    if (!enabled.contains(controller)) {
+      std::cerr << std::format("The {} controller is not enabled in {}, jobs "
+                               "will only be bound with hwloc",
+                               controller, root)
+                << std::endl;
+      return;
+    }
+  }
+  auto path = std::filesystem::path{root} / std::format("tsp-{}", uuid);
+  if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+    std::cerr << std::format("Unable to create cgroup {}: {}", path.string(),
+                             strerror(errno))
+              << std::endl;
+    return;
+  }
+  if ((procs_fd_ = open((path / "cgroup.procs").c_str(),
+                        O_WRONLY | O_CLOEXEC)) == -1) {
+    std::cerr << std::format("Unable to open {}: {}",
+                             (path / "cgroup.procs").string(), strerror(errno))
+              << std::endl;
+    rmdir(path.c_str());
+    return;
+  }
+  path_ = path;
+}
+
+Job_cgroup::~Job_cgroup() { disable(); }
+
+void Job_cgroup::disable() {
+  if (procs_fd_ != -1) {
+    close(procs_fd_);
+    procs_fd_ = -1;
+  }
+  // Fails if anything the job started is still running, the cgroup is
+  // left behind with it
+  if (!path_.empty()) {
+    rmdir(path_.c_str());
+    path_.clear();
+  }
+}
+
+bool Job_cgroup::active() { return !path_.empty(); }
+
+std::filesystem::path Job_cgroup::path() { return path_; }
+
+bool Job_cgroup::write_file(const char *name, const std::string &val) {
+  if (!active()) {
+    return false;
+  }
+  auto fd = open((path_ / name).c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  auto ret = write(fd, val.data(), val.size());
+  close(fd);
+  return ret == static_cast<ssize_t>(val.size());
+}
+
+bool Job_cgroup::set_cpus(const std::string &cpus) {
+  return write_file("cpuset.cpus", cpus);
+}
+
+bool Job_cgroup::set_mems(const std::string &mems) {
+  return write_file("cpuset.mems", mems);
+}
+
+bool Job_cgroup::set_memory_max(int64_t bytes) {
+  return write_file("memory.max", std::to_string(bytes));
+}
+
+void Job_cgroup::enter() {
+  if (procs_fd_ != -1) {
+    // 0 is the writing process
+    if (write(procs_fd_, "0", 1) != 1) {
+      constexpr std::string_view msg{"Unable to enter job cgroup\n"};
+      auto ret = write(STDERR_FILENO, msg.data(), msg.size());
+      (void)ret;
+    }
+  }
+}
+
+} // namespace tsp
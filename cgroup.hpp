@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace tsp {
+
+// A delegated cgroup v2 directory that tsp may create job cgroups under
+constexpr std::string_view cgroup_root_env{"TSP_CGROUP_ROOT"};
+
+// One child cgroup of TSP_CGROUP_ROOT per job. Processes in it can't
+// bind themselves outside of its cpuset, and memprof reads its accounting
+// instead of walking /proc. When TSP_CGROUP_ROOT isn't set or usable,
+// active() is false and jobs are only bound with hwloc.
+class Job_cgroup {
+public:
+  Job_cgroup(const std::string &uuid);
+  ~Job_cgroup();
+  Job_cgroup(const Job_cgroup &) = delete;
+  Job_cgroup &operator=(const Job_cgroup &) = delete;
+  bool active();
+  std::filesystem::path path();
+  // cpus and mems are OS indices in list format, e.g. 0-3,8
+  bool set_cpus(const std::string &cpus);
+  bool set_mems(const std::string &mems);
+  bool set_memory_max(int64_t bytes);
+  // Stops using the cgroup, e.g. because it couldn't be set up to match
+  // the job's allocation. active() is false afterwards.
+  void disable();
+  // Moves the calling process into the cgroup. Only makes async-signal-safe
+  // calls so it can be used between fork and exec.
+  void enter();
+
+private:
+  std::filesystem::path path_;
+  int procs_fd_;
+  bool write_file(const char *name, const std::string &val);
+};
+
+} // namespace tsp
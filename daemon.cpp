@@ -0,0 +1,331 @@
+#include "daemon.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "backfill.hpp"
+#include "daemon_manager.hpp"
+#include "functions.hpp"
+#include "proc_affinity.hpp"
+#include "slot_watcher.hpp"
+#include "spooler.hpp"
+
+bool daemon_time_to_die = false;
+
+void sigHandlerDaemon(int sig) { daemon_time_to_die = true; }
+
+namespace tsp {
+
+// How often to check for the idle timeout if nothing else wakes us
+constexpr std::chrono::milliseconds daemon_tick{1000};
+
+struct daemon_client_conn {
+  int fd;
+  std::string inbuf;
+  std::string uuid;
+  int32_t nslots;
+  Distribution distribution;
+  Smt smt;
+  bool requested;
+  std::vector<uint32_t> slots;
+};
+
+Daemon_config::Daemon_config() {
+  bool_vars = {{"verbose", false}, {"do_fork", true}};
+  int_vars = {{"idle_timeout", 30}};
+}
+
+int open_daemon_socket(const std::filesystem::path &sock_fn) {
+  struct sockaddr_un addr = {};
+  if (sock_fn.string().size() >= sizeof(addr.sun_path)) {
+    die_with_err(std::format("Daemon socket path {} is too long",
+                             sock_fn.string()),
+                 -1);
+  }
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, sock_fn.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd;
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    die_with_err_errno("Unable to create daemon socket", fd);
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (std::filesystem::exists(sock_fn)) {
+    // Is there already a daemon on this node?
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr)) == 0) {
+      close(fd);
+      die_with_err("A tsp daemon is already running on this node", -1);
+    }
+    // Stale socket from a daemon that didn't exit cleanly
+    std::filesystem::remove(sock_fn);
+  }
+  if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ==
+      -1) {
+    die_with_err_errno("Unable to bind daemon socket", -1);
+  }
+  if (listen(fd, SOMAXCONN) == -1) {
+    die_with_err_errno("Unable to listen on daemon socket", -1);
+  }
+  return fd;
+}
+
+int do_daemon(Daemon_config conf) {
+
+  if (conf.get_bool("do_fork")) {
+    auto main_fork_pid = pid_t{fork()};
+    if (main_fork_pid == -1) {
+      die_with_err("Unable to fork when forking requested", main_fork_pid);
+    }
+    if (main_fork_pid != 0) {
+      // We're done here
+      return 0;
+    }
+  }
+
+  auto stat = tsp::Daemon_Manager{};
+  auto binder = tsp::Proc_affinity{stat, 1, getpid()};
+  if (!binder.error_string.empty()) {
+    die_with_err(binder.error_string, -1);
+  }
+  auto watcher = tsp::Slot_watcher{};
+  auto sock_fn = get_tmp() / daemon_socket_name;
+  auto listen_fd = open_daemon_socket(sock_fn);
+
+  for (const auto sig : {SIGINT, SIGHUP, SIGTERM}) {
+    signal(sig, sigHandlerDaemon);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  // The authoritative slot map lives in the database, this is a cache
+  // of it that is refreshed whenever a job anywhere on the node ends.
+  std::vector<bool> slot_used;
+  auto resync = [&]() {
+    if (slot_unit_from_string(
+            stat.get_node_setting(std::string{slot_unit_setting})) !=
+        binder.slot_unit()) {
+      // Slot numbers no longer mean what we think they do. Jobs that
+      // were waiting on us will fall back to serverless allocation.
+      if (conf.get_bool("verbose")) {
+        std::cout << "Slot unit changed. Exiting" << std::endl;
+      }
+      daemon_time_to_die = true;
+      return;
+    }
+    slot_used.assign(binder.total_slots(), false);
+    for (const auto s : stat.get_slots_in_use()) {
+      if (s < slot_used.size()) {
+        slot_used[s] = true;
+      }
+    }
+  };
+  resync();
+
+  std::list<daemon_client_conn> clients;
+  auto last_active = now();
+  auto idle_timeout = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::seconds(conf.get_int("idle_timeout")))
+                          .count();
+
+  auto release = [&](daemon_client_conn &c) {
+    close(c.fd);
+    if (!c.slots.empty()) {
+      // Client has gone away, if it didn't get to record an end time
+      // (e.g. it was SIGKILLed) do that on its behalf
+      stat.job_abandoned(c.uuid);
+      // Its dependents, and those of anything cancelled with it, have
+      // no one else to start them. Nor does anything it left queued.
+      start_eligible_jobs(stat.get_eligible_dependents());
+      start_queue_runner(stat);
+      for (const auto s : c.slots) {
+        slot_used[s] = false;
+      }
+      if (conf.get_bool("verbose")) {
+        std::cout << "Released " << c.slots.size() << " slots from job "
+                  << c.uuid << std::endl;
+      }
+    }
+  };
+
+  while (!daemon_time_to_die) {
+    // Clear up after dependent job runners started from release
+    while (waitpid(-1, nullptr, WNOHANG) > 0) {
+    }
+    std::vector<struct pollfd> pfds;
+    pfds.push_back({listen_fd, POLLIN, 0});
+    pfds.push_back({watcher.get_fd(), POLLIN, 0});
+    for (const auto &c : clients) {
+      pfds.push_back({c.fd, POLLIN, 0});
+    }
+    if (poll(pfds.data(), pfds.size(), daemon_tick.count()) == -1) {
+      // Most likely EINTR from a signal, check daemon_time_to_die
+      continue;
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      watcher.drain();
+      resync();
+      if (daemon_time_to_die) {
+        break;
+      }
+    }
+
+    auto pfd_it = pfds.begin() + 2;
+    for (auto it = clients.begin(); it != clients.end(); ++pfd_it) {
+      if (!(pfd_it->revents & (POLLIN | POLLHUP | POLLERR))) {
+        ++it;
+        continue;
+      }
+      char buf[1024];
+      auto len = recv(it->fd, buf, sizeof(buf), 0);
+      if (len <= 0) {
+        release(*it);
+        it = clients.erase(it);
+        continue;
+      }
+      it->inbuf.append(buf, len);
+      auto eol = it->inbuf.find('\n');
+      if (eol != std::string::npos && !it->requested) {
+        std::stringstream ss{it->inbuf.substr(0, eol)};
+        std::string cmd;
+        std::string dist;
+        std::string smt_str;
+        ss >> cmd >> it->uuid >> it->nslots;
+        auto parsed = !ss.fail();
+        // Distribution and SMT policy are optional
+        ss >> dist >> smt_str;
+        auto distribution = distribution_from_string(dist);
+        auto smt = smt_from_string(smt_str);
+        if (cmd != "alloc" || !parsed || !distribution || !smt ||
+            it->nslots < 1 || it->nslots > binder.capacity(smt.value())) {
+          std::string msg{"error invalid allocation request\n"};
+          send(it->fd, msg.data(), msg.size(), 0);
+          close(it->fd);
+          it = clients.erase(it);
+          continue;
+        }
+        it->distribution = distribution.value();
+        it->smt = smt.value();
+        it->requested = true;
+        if (conf.get_bool("verbose")) {
+          std::cout << "Job " << it->uuid << " requesting " << it->nslots
+                    << " slots" << std::endl;
+        }
+      }
+      ++it;
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      int fd;
+      if ((fd = accept(listen_fd, nullptr, nullptr)) != -1) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        clients.push_back(
+            {fd, {}, {}, 0, Distribution::compact, Smt::use, false, {}});
+      }
+    }
+
+    // Grant requests in order of arrival, unless that would delay the
+    // reservation held by the oldest waiting job on the node
+    std::vector<waiting_job> waiting;
+    std::vector<running_alloc> running;
+    int64_t mem_budget;
+    auto refresh = true;
+    for (auto &c : clients) {
+      if (!c.requested || !c.slots.empty()) {
+        continue;
+      }
+      if (refresh) {
+        waiting = stat.get_waiting_jobs();
+        running = stat.get_running_allocations();
+        mem_budget = stat.get_mem_budget().value_or(
+            std::numeric_limits<int64_t>::max());
+        refresh = false;
+      }
+      std::vector<uint32_t> in_use;
+      for (uint32_t s = 0; s < slot_used.size(); ++s) {
+        if (slot_used[s]) {
+          in_use.push_back(s);
+        }
+      }
+      auto placeable = [&](const waiting_job &w) {
+        return !binder
+                    .choose_slots(
+                        in_use, w.slots,
+                        distribution_from_string(w.distribution)
+                            .value_or(Distribution::compact),
+                        smt_from_string(w.smt).value_or(Smt::use))
+                    .empty();
+      };
+      if (!backfill_allows(c.uuid, waiting, running, binder.total_slots(),
+                           mem_budget, now(), placeable)) {
+        continue;
+      }
+      auto candidate =
+          binder.choose_slots(in_use, c.nslots, c.distribution, c.smt);
+      if (candidate.empty()) {
+        continue;
+      }
+      if (!stat.allocate_slots(c.uuid, candidate)) {
+        // A serverless tsp instance got there first
+        resync();
+        continue;
+      }
+      for (const auto s : candidate) {
+        slot_used[s] = true;
+      }
+      c.slots = candidate;
+      refresh = true;
+      std::string msg{"slots"};
+      for (const auto s : candidate) {
+        msg += std::format(" {}", s);
+      }
+      if (conf.get_bool("verbose")) {
+        std::cout << "Granted " << msg << " to job " << c.uuid << std::endl;
+      }
+      msg += "\n";
+      send(c.fd, msg.data(), msg.size(), 0);
+    }
+
+    if (clients.empty()) {
+      if (now() - last_active > idle_timeout) {
+        if (conf.get_bool("verbose")) {
+          std::cout << "Idle timeout: " << conf.get_int("idle_timeout")
+                    << " seconds reached. Exiting" << std::endl;
+        }
+        break;
+      }
+    } else {
+      last_active = now();
+    }
+  }
+
+  close(listen_fd);
+  std::filesystem::remove(sock_fn);
+  // Jobs we've granted slots to are still running and recorded in the
+  // database, so they're safe to leave behind. Anyone still waiting
+  // will fall back to serverless allocation.
+  for (auto &c : clients) {
+    close(c.fd);
+  }
+  return EXIT_SUCCESS;
+}
+
+} // namespace tsp
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string_view>
+
+#include "generic_config.hpp"
+
+namespace tsp {
+
+constexpr std::string_view daemon_socket_name{"tsp_daemon.sock"};
+
+class Daemon_config : public Generic_config {
+public:
+  Daemon_config();
+};
+
+int do_daemon(Daemon_config conf);
+} // namespace tsp
@@ -0,0 +1,111 @@
+#include "daemon_client.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.hpp"
+#include "functions.hpp"
+
+// Not available on macOS
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace tsp {
+
+Daemon_client::Daemon_client() : fd_(-1) {}
+
+Daemon_client::~Daemon_client() { disconnect(); }
+
+void Daemon_client::disconnect() {
+  if (fd_ != -1) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool Daemon_client::connected() { return fd_ != -1; }
+
+bool Daemon_client::request_allocation(const std::string &uuid,
+                                       int32_t nslots, Distribution d,
+                                       Smt smt) {
+  auto sock_fn = (get_tmp() / daemon_socket_name).string();
+  struct sockaddr_un addr = {};
+  if (sock_fn.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, sock_fn.c_str(), sizeof(addr.sun_path) - 1);
+
+  // The connection is held open until this process exits, that is how
+  // the daemon knows our slots have been released. Don't leak it into
+  // the job itself.
+  if ((fd_ = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    return false;
+  }
+  fcntl(fd_, F_SETFD, FD_CLOEXEC);
+  if (connect(fd_, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) == -1) {
+    // No daemon, or a stale socket left behind by one
+    disconnect();
+    return false;
+  }
+  auto msg = std::format("alloc {} {} {} {}\n", uuid, nslots,
+                         distribution_to_string(d), smt_to_string(smt));
+  if (send(fd_, msg.data(), msg.size(), MSG_NOSIGNAL) !=
+      static_cast<ssize_t>(msg.size())) {
+    disconnect();
+    return false;
+  }
+  return true;
+}
+
+std::vector<uint32_t>
+Daemon_client::wait_for_allocation(std::chrono::milliseconds timeout) {
+  if (fd_ == -1) {
+    return {};
+  }
+  struct pollfd pfd = {fd_, POLLIN, 0};
+  if (poll(&pfd, 1, timeout.count()) <= 0) {
+    return {};
+  }
+  char buf[1024];
+  auto len = recv(fd_, buf, sizeof(buf), 0);
+  if (len <= 0) {
+    disconnect();
+    return {};
+  }
+  inbuf_.append(buf, len);
+  auto eol = inbuf_.find('\n');
+  if (eol == std::string::npos) {
+    return {};
+  }
+  std::stringstream ss{inbuf_.substr(0, eol)};
+  inbuf_.erase(0, eol + 1);
+  std::string tok;
+  ss >> tok;
+  if (tok != "slots") {
+    // Daemon refused the request, let the serverless path sort it out
+    disconnect();
+    return {};
+  }
+  std::vector<uint32_t> out;
+  uint32_t slot;
+  while (ss >> slot) {
+    out.push_back(slot);
+  }
+  return out;
+}
+
+} // namespace tsp
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "proc_affinity.hpp"
+
+namespace tsp {
+
+class Daemon_client {
+public:
+  Daemon_client();
+  ~Daemon_client();
+  // Returns false if no daemon is listening, in which case the caller
+  // should fall back to serverless allocation
+  bool request_allocation(const std::string &uuid, int32_t nslots,
+                          Distribution d, Smt smt);
+  // Returns an empty vector on timeout or if the daemon has gone away
+  std::vector<uint32_t> wait_for_allocation(std::chrono::milliseconds timeout);
+  bool connected();
+
+private:
+  int fd_;
+  std::string inbuf_;
+  void disconnect();
+};
+} // namespace tsp
@@ -0,0 +1,35 @@
+#include "daemon_manager.hpp"
+
+#include <cstdint>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+#include "functions.hpp"
+#include "slot_watcher.hpp"
+#include "sqlite_statement_manager.hpp"
+
+namespace tsp {
+
+Daemon_Manager::Daemon_Manager() : Status_Manager() {}
+
+bool Daemon_Manager::allocate_slots(const std::string &uuid,
+                                    const std::vector<uint32_t> &slots) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  return insert_proc_allocation(uuid, slots);
+}
+
+void Daemon_Manager::job_abandoned(const std::string &uuid) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  Sqlite_statement_manager(conn_, stmts_, insert_abandoned_etime_stmt)
+      .step(-1, now(), uuid);
+  cancel_failed_dependents();
+  // Its slots are free again, wake any jobs waiting on them
+  notify_slot_watchers();
+}
+
+} // namespace tsp
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "status_manager.hpp"
+
+namespace tsp {
+
+constexpr std::string_view insert_abandoned_etime_stmt(
+    "UPDATE jobs SET exit_status = ?, etime = ? WHERE uuid = ? AND etime IS "
+    "NULL;");
+
+class Daemon_Manager : public Status_Manager {
+public:
+  Daemon_Manager();
+  bool allocate_slots(const std::string &uuid,
+                      const std::vector<uint32_t> &slots);
+  void job_abandoned(const std::string &uuid);
+};
+
+} // namespace tsp
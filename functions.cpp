@@ -1,13 +1,19 @@
 #include "functions.hpp"
 
+#include <cerrno>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <format>
+#include <fstream>
 #include <iostream>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <signal.h>
+#include <sys/types.h>
+#include <unistd.h>
 #include <vector>
 
 namespace tsp {
@@ -61,4 +67,159 @@ std::string format_hh_mm_ss(int64_t us_duration) {
   }
 }
 
+// Inverse of format_hh_mm_ss, accepts [[hh:]mm:]ss with no fraction
+std::optional<int64_t> parse_hh_mm_ss(std::string_view in) {
+  int64_t out = 0;
+  int64_t field = 0;
+  auto nfields = 0;
+  auto has_digit = false;
+  for (const auto c : in) {
+    if (c >= '0' && c <= '9') {
+      field = field * 10 + (c - '0');
+      has_digit = true;
+    } else if (c == ':' && has_digit && ++nfields < 3) {
+      out = (out + field) * 60;
+      field = 0;
+      has_digit = false;
+    } else {
+      return std::nullopt;
+    }
+  }
+  if (!has_digit) {
+    return std::nullopt;
+  }
+  return (out + field) * 1000000ll;
+}
+
+// Memory size in bytes from N[K|M|G|T], MiB if there is no suffix.
+// Sizes that don't fit in 64 bits are invalid.
+std::optional<int64_t> parse_size(std::string_view in) {
+  int64_t out = 0;
+  auto ndigits = 0;
+  for (; ndigits < static_cast<int>(in.size()) && in[ndigits] >= '0' &&
+         in[ndigits] <= '9';
+       ++ndigits) {
+    if (__builtin_mul_overflow(out, 10, &out) ||
+        __builtin_add_overflow(out, in[ndigits] - '0', &out)) {
+      return std::nullopt;
+    }
+  }
+  if (ndigits == 0) {
+    return std::nullopt;
+  }
+  auto suffix = in.substr(ndigits);
+  auto shift = 20;
+  if (suffix.size() > 1) {
+    return std::nullopt;
+  }
+  if (!suffix.empty()) {
+    switch (suffix[0]) {
+    case 'K':
+    case 'k':
+      shift = 10;
+      break;
+    case 'M':
+    case 'm':
+      shift = 20;
+      break;
+    case 'G':
+    case 'g':
+      shift = 30;
+      break;
+    case 'T':
+    case 't':
+      shift = 40;
+      break;
+    default:
+      return std::nullopt;
+    }
+  }
+  if (__builtin_mul_overflow(out, int64_t{1} << shift, &out)) {
+    return std::nullopt;
+  }
+  return out;
+}
+
+std::vector<std::string> split_cmdline(std::string_view line) {
+  // Minimal POSIX shell-style word splitting. Handles single quotes,
+  // double quotes and backslash escapes, but no expansions.
+  std::vector<std::string> out;
+  std::string tok;
+  bool in_tok = false;
+  char quote = '\0';
+  for (auto i = 0ul; i < line.size(); ++i) {
+    auto c = line[i];
+    if (quote == '\'') {
+      if (c == '\'') {
+        quote = '\0';
+      } else {
+        tok += c;
+      }
+    } else if (quote == '"') {
+      if (c == '"') {
+        quote = '\0';
+      } else if (c == '\\' && i + 1 < line.size() &&
+                 std::string_view{"\"\\$`"}.contains(line[i + 1])) {
+        tok += line[++i];
+      } else {
+        tok += c;
+      }
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      in_tok = true;
+    } else if (c == '\\' && i + 1 < line.size()) {
+      tok += line[++i];
+      in_tok = true;
+    } else if (c == ' ' || c == '\t') {
+      if (in_tok) {
+        out.push_back(tok);
+        tok.clear();
+        in_tok = false;
+      }
+    } else {
+      tok += c;
+      in_tok = true;
+    }
+  }
+  if (in_tok) {
+    out.push_back(tok);
+  }
+  return out;
+}
+
+// Closes everything but stdin, stdout and stderr, for processes forked to
+// outlive the one that started them
+void close_inherited_fds() {
+  std::vector<int> fds;
+  std::error_code ec;
+  for (const auto &entry :
+       std::filesystem::directory_iterator("/dev/fd", ec)) {
+    auto fd = std::atoi(entry.path().filename().c_str());
+    if (fd > 2) {
+      fds.push_back(fd);
+    }
+  }
+  // One of them was the directory itself, which is already closed
+  for (const auto fd : fds) {
+    close(fd);
+  }
+}
+
+// A process that has exited but not yet been waited on still accepts
+// signals, so look at its state as well where that's possible
+bool process_is_alive(pid_t pid) {
+  if (kill(pid, 0) == -1 && errno == ESRCH) {
+    return false;
+  }
+  std::ifstream stat_file{std::format("/proc/{}/stat", pid)};
+  std::string line;
+  if (!std::getline(stat_file, line)) {
+    return true;
+  }
+  // The command name can contain anything, the state follows it
+  auto name_end = line.rfind(')');
+  return name_end == std::string::npos || name_end + 2 >= line.size() ||
+         line[name_end + 2] != 'Z';
+}
+
 } // namespace tsp
\ No newline at end of file
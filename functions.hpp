@@ -2,11 +2,14 @@
 
 #include <cstdint>
 #include <filesystem>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include <sys/types.h>
+
 namespace tsp {
 
 const std::filesystem::path get_tmp();
@@ -14,4 +17,9 @@ void die_with_err(std::string_view msg, int status);
 void die_with_err_errno(std::string_view msg, int status);
 int64_t now();
 std::string format_hh_mm_ss(int64_t us_duration);
+std::optional<int64_t> parse_hh_mm_ss(std::string_view in);
+std::optional<int64_t> parse_size(std::string_view in);
+std::vector<std::string> split_cmdline(std::string_view line);
+void close_inherited_fds();
+bool process_is_alive(pid_t pid);
 } // namespace tsp
\ No newline at end of file
@@ -1,6 +1,7 @@
 
 #include <cstdint>
 #include <map>
+#include <sstream>
 #include <string>
 
 #include "generic_config.hpp"
@@ -23,5 +24,36 @@ void Generic_config::set_string(std::string key, std::string val) {
 void Generic_config::set_bool(std::string key, bool val) {
   bool_vars[key] = val;
 };
+std::string Generic_config::serialise() {
+  std::stringstream ss;
+  for (const auto &[key, val] : bool_vars) {
+    ss << "b " << key << " " << val << "\n";
+  }
+  for (const auto &[key, val] : int_vars) {
+    ss << "i " << key << " " << val << "\n";
+  }
+  for (const auto &[key, val] : str_vars) {
+    ss << "s " << key << " " << val << "\n";
+  }
+  return ss.str();
+};
+void Generic_config::deserialise(const std::string &in) {
+  std::stringstream ss{in};
+  std::string line;
+  while (std::getline(ss, line)) {
+    std::stringstream ls{line};
+    std::string type;
+    std::string key;
+    ls >> type >> key;
+    ls.get();
+    if (type == "b") {
+      ls >> bool_vars[key];
+    } else if (type == "i") {
+      ls >> int_vars[key];
+    } else if (type == "s") {
+      std::getline(ls, str_vars[key]);
+    }
+  }
+};
 
 } // namespace tsp
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <map>
+#include <sstream>
 #include <string>
 
 namespace tsp {
@@ -15,6 +16,9 @@ public:
   void set_int(std::string key, uint32_t val);
   void set_string(std::string key, std::string val);
   void set_bool(std::string key, bool val);
+  // One "type key value" line per setting, for jobs run by another process
+  std::string serialise();
+  void deserialise(const std::string &in);
 
 protected:
   std::map<std::string, bool> bool_vars{};
@@ -12,7 +12,8 @@ constexpr std::string_view help{
     "bound\n"
     " to. When sufficient cores are free, TSP will allow its queued task to "
     "run\n"
-    " and bind it to the first N available cores. State is managed through an "
+    " and bind it to N available cores, chosen to share caches/NUMA nodes where\n"
+    " possible. State is managed through an "
     "\n"
     " sqlite3 database which can be queried using the TSP command.\n\n"
     " When 'Job Querying Options' are present, the first such option will\n"
@@ -28,6 +29,19 @@ constexpr std::string_view help{
     " TSP in this mode. If no other running TSP processes are detected over "
     "the idle\n"
     " timeout period, TSP will automatically shut down\n\n"
+    " A resident scheduler mode is available when the --daemon flag is "
+    "passed\n"
+    " to TSP. In this mode, TSP listens on a socket in the TSP temporary\n"
+    " directory and hands out CPU cores to newly submitted jobs without "
+    "them\n"
+    " needing to poll the database. If no daemon is running, jobs fall back "
+    "to\n"
+    " the serverless behaviour. The daemon exits when no jobs have been\n"
+    " connected to it over an idle timeout period.\n\n"
+    " If TSP_CGROUP_ROOT is set to a delegated cgroup v2 directory, each job\n"
+    " runs in a cgroup of its own under it. The cgroup is limited to the\n"
+    " job's cores, and to its memory when --mem=SIZE is given, so the job\n"
+    " can't escape its binding. Otherwise jobs are bound with hwloc alone.\n\n"
 // Disable memprof on not-linux systems
 #ifdef __linux__
     " A memory profiling mode is available when the --memprof flag is passed\n"
@@ -36,7 +50,16 @@ constexpr std::string_view help{
     "Like\n"
     " timeout mode, when no other TSP-controlled running jobs are detected "
     "over\n"
-    " an idle timeout period, TSP will automatically shut down.\n\n"
+    " an idle timeout period, TSP will automatically shut down. Profiles are\n"
+    " kept in a database of their own, tsp_memprof.sqlite3, next to the job\n"
+    " database. CPU time, I/O, context switches and thread counts are\n"
+    " recorded along with memory, and -i shows a job's CPU use against the\n"
+    " slots it was given. Virtual memory is the vsize field of\n"
+    " /proc/PID/stat, the same address space size statm used to give.\n"
+    " Jobs in a cgroup with the memory controller are read from the\n"
+    " cgroup's memory.stat, cpu.stat, io.stat and cgroup.threads instead.\n"
+    " That path has only been checked against copies of those files, not\n"
+    " yet on a host with a live cgroup v2 memory controller.\n\n"
 #endif
     "Usage: {} [OPTION]... [COMMAND...] \n\n"
     "Global options:\n"
@@ -46,23 +69,117 @@ constexpr std::string_view help{
     "ends\n\n"
     "Job Submission Options:\n"
     "  -n, --no-output        Do not store stdout/stderr of COMMAND\n"
-    "  -N, --nslots=SLOTS     Number of physical cores required (default is "
-    "1)\n"
+    "  -N, --nslots=SLOTS     Number of slots required (default is 1). A slot "
+    "is a\n"
+    "                         physical core unless --slot-unit=pu\n"
     "  -E, --separate-stderr  Store stdout and stderr in different files\n"
+    "      --max-output=SIZE[:HEAD:TAIL]\n"
+    "                         Only keep the first HEAD and last TAIL bytes of "
+    "each\n"
+    "                         output stream, as N[K|M|G|T] (MB if no unit). "
+    "HEAD\n"
+    "                         and TAIL default to half of SIZE each. The job "
+    "writes\n"
+    "                         to a pipe, so the rest never reaches disk.\n"
+    "      --distribution=POLICY\n"
+    "                         How to choose cores for multi-slot jobs. One "
+    "of:\n"
+    "                         compact (default) - smallest topology domain "
+    "that fits\n"
+    "                         cache - best fitting shared cache, then NUMA "
+    "node\n"
+    "                         scatter - spread across NUMA nodes/packages\n"
+    "                         linear - lowest numbered free cores\n"
+    "      --membind=POLICY   Place the job's memory on the NUMA nodes of its\n"
+    "                         cores. One of:\n"
+    "                         bind - only allocate on those nodes\n"
+    "                         interleave - spread pages across those nodes\n"
+    "                         preferred - use those nodes first\n"
+    "                         none (default) - first touch\n"
+    "      --slot-unit=UNIT   What a slot is on this node, core (default) or "
+    "pu\n"
+    "                         (hardware thread). Applies to every job and can "
+    "only\n"
+    "                         be changed while no jobs are running or "
+    "queued.\n"
+    "      --smt=POLICY       use (default) - run on every hardware thread of "
+    "the\n"
+    "                         job's slots\n"
+    "                         idle - reserve whole cores and leave their SMT\n"
+    "                         siblings idle\n"
+    "      --est-time=TIME    Expected run time of COMMAND as [[hh:]mm:]ss. "
+    "Lets\n"
+    "                         it start ahead of older, wider jobs that are "
+    "waiting\n"
+    "                         for cores, as long as it won't delay them. "
+    "Without\n"
+    "                         this, the longest previous successful run of "
+    "the\n"
+    "                         same command is used.\n"
+    "      --priority=N       Jobs with a higher priority get free cores "
+    "first.\n"
+    "                         Default is 0, may be negative.\n"
+    "      --fair-share=on|off\n"
+    "                         Node-wide. When on, among jobs of equal "
+    "priority\n"
+    "                         those whose label holds the fewest cores go "
+    "first.\n"
+    "      --mem=SIZE         Memory to reserve for COMMAND, as N[K|M|G|T] "
+    "(MB if\n"
+    "                         no unit). Jobs only start when their "
+    "reservation fits\n"
+    "                         in the node's memory budget alongside those "
+    "of running\n"
+    "                         jobs. 'auto' reserves the peak RSS recorded "
+    "by --memprof\n"
+    "                         for the same command or label.\n"
+    "      --mem-budget=SIZE  Node-wide. Total memory that can be reserved. "
+    "Defaults\n"
+    "                         to all of the node's memory.\n"
+    "      --after=ID[,ID]    Don't start until jobs ID have finished\n"
+    "      --afterok=ID[,ID]  Don't start until jobs ID have finished "
+    "successfully.\n"
+    "                         If any fail, this job is cancelled, as is "
+    "anything\n"
+    "                         that depends on it. No tsp process is left "
+    "waiting\n"
+    "                         for a dependent job, one is started when it "
+    "is ready.\n"
     "  -L, --label=LABEL      Add a label to the task to facilitate simpler "
     "querying\n"
-    "  -r, --rerun=ID         Rerun job with id ID\n\n"
+    "  -r, --rerun=ID         Rerun job with id ID\n"
+    "      --batch=FILE       Queue every line of FILE (- for stdin) as a "
+    "separate\n"
+    "                         command. Lines are split into words like a "
+    "shell\n"
+    "                         would, without expansions. Queued jobs left "
+    "behind\n"
+    "                         by earlier batches are picked up too.\n"
+    "      --array=FIRST-LAST[:STEP]\n"
+    "                         Queue COMMAND once for each index in the range. "
+    "{{}}\n"
+    "                         in COMMAND is replaced by the index, which is "
+    "also in\n"
+    "                         TSP_ARRAY_INDEX. Members are only recorded "
+    "as jobs\n"
+    "                         once they start.\n\n"
     "Timeout Mode Options:\n"
     "      --timeout          Run the TSP timeout function\n"
     "  -p  --polling-interval=T\n"
     "                         Poll for running TSP instances every T seconds. "
     "Default is 10.\n"
+    "                         Fractions are rounded up to whole seconds\n"
     "  -I  --idle-timeout=T   If TSP has not detected any running jobs in T "
     "seconds, exit.\n"
     "                         Default is 30\n"
     "  -T  --job-timeout=T    How many seconds other TSP instances should be "
     "allowed to run.\n"
     "                         Default is 7200 (2 hours)\n\n"
+    "Daemon Mode Options:\n"
+    "      --daemon           Run the TSP node scheduler daemon\n"
+    "  -I  --idle-timeout=T   If no jobs have been connected for T seconds, "
+    "exit.\n"
+    "                         Default is 30\n\n"
 // Disable memprof on not-linux systems
 #ifdef __linux__
     "Memory Profiling Mode Options:\n"
@@ -70,6 +187,24 @@ constexpr std::string_view help{
     "  -p  --polling-interval=T\n"
     "                         Poll for running TSP instances every T seconds. "
     "Default is 10.\n"
+    "                         May be a fraction, e.g. 0.5\n"
+    "      --memprof-threads=N\n"
+    "                         Sample jobs with N threads. Default is 1. "
+    "memprof\n"
+    "                         keeps off the cores jobs are bound to.\n"
+    "      --smaps-interval=T Read PSS and shared memory, which is costly for large\n"
+    "                         processes, every T seconds. Other fields are read\n"
+    "                         every poll. Default is 60.\n"
+    "      --raw-keep=T       Keep every sample for T seconds. Default is "
+    "3600.\n"
+    "      --rollup-period=T  Then keep one row per job per T seconds. "
+    "Default\n"
+    "                         is 60.\n"
+    "      --rollup-keep=T    Once a job has not been sampled for T seconds, "
+    "keep\n"
+    "                         only its summary. 0 keeps rows forever. "
+    "Default is\n"
+    "                         604800 (one week).\n"
     "  -I  --idle-timeout=T   If TSP has not detected any running jobs in T "
     "seconds, exit.\n"
     "                         Default is 30\n\n"
@@ -80,6 +215,7 @@ constexpr std::string_view help{
     "      --list-running     Show the list of running jobs\n"
     "      --list-queued      Show the list of queued jobs\n"
     "      --list-finished    Show the list of finished jobs\n"
+    "      --list-array=AID   Show the members of array AID\n"
     "      --print-queue-time=[ID]\n"
     "      --print-run-time=[ID]\n"
     "      --print-total-time=[ID]\n"
@@ -93,6 +229,11 @@ constexpr std::string_view help{
     "                         is omitted)\n"
     "  -e, --stderr=[ID]      If -E was provided, display the error file of \n"
     "                         the job [ID] (latest if ID is omitted)\n"
+    "      --follow=[ID]      Print the output of job [ID] as it is written "
+    "until\n"
+    "                         it ends, then exit with its status (latest if "
+    "ID is\n"
+    "                         omitted)\n"
     "      --db-path          Output the path to the database\n"
     "      --gh-summary       Output summary info for github actions\n\n"
     "Other Options:\n"
@@ -1,120 +1,543 @@
 #include "linux_proc_tools.hpp"
 
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstdint>
-#include <filesystem>
-#include <format>
-#include <fstream>
-#include <iostream>
-#include <numeric>
-#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <string_view>
+#include <sys/syscall.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 
 #include "functions.hpp"
 
 namespace tsp {
 
-uint64_t parse_smaps_line(std::string line) {
-  auto second_field_start = line.find(":") + 1;
-  auto second_field_end = line.find("k", second_field_start) - 1;
-  return std::stoull(
-      line.substr(second_field_start, second_field_end - second_field_start));
-}
-
-void parse_smaps(pid_t pid, mem_data &data) {
-  auto smaps_file_path = std::format("/proc/{}/smaps_rollup", pid);
-  std::ifstream smaps_file(smaps_file_path);
-  std::string line;
-  if (smaps_file.is_open()) {
-    while (std::getline(smaps_file, line)) {
-      if (line.starts_with("Rss:")) {
-        data.rss += parse_smaps_line(line);
-      }
-      if (line.starts_with("Pss:")) {
-        data.pss += parse_smaps_line(line);
-      }
-      if (line.starts_with("Shared_Clean:")) {
-        data.shared += parse_smaps_line(line);
+namespace {
+
+// As filled in by getdents64, which glibc only wraps from 2.30
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+uint64_t parse_u64(const char *&p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    ++p;
+  }
+  uint64_t out = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    out = out * 10 + (*p++ - '0');
+  }
+  return out;
+}
+
+// Value of the 'key N' line in a status, smaps or memory.stat file. key
+// includes the separator.
+uint64_t find_field(std::string_view buf, std::string_view key) {
+  for (size_t pos = 0; pos < buf.size();) {
+    if (buf.compare(pos, key.size(), key) == 0) {
+      const char *p = buf.data() + pos + key.size();
+      return parse_u64(p, buf.data() + buf.size());
+    }
+    pos = buf.find('\n', pos);
+    if (pos == std::string_view::npos) {
+      break;
+    }
+    ++pos;
+  }
+  return 0;
+}
+
+// Sum of every 'key N' in the file, for files like io.stat with a line
+// per device
+uint64_t sum_field(std::string_view buf, std::string_view key) {
+  uint64_t out = 0;
+  for (auto pos = buf.find(key); pos != std::string_view::npos;
+       pos = buf.find(key, pos + key.size())) {
+    const char *p = buf.data() + pos + key.size();
+    out += parse_u64(p, buf.data() + buf.size());
+  }
+  return out;
+}
+
+// Moves p in a stat file from the space before field from to the space
+// before field to. Returns false if the file is cut short.
+bool skip_fields(const char *&p, const char *end, int from, int to) {
+  for (int i = from; i < to && p < end; ++i) {
+    p = static_cast<const char *>(memchr(p + 1, ' ', end - p - 1));
+    if (p == nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string_view read_into(int dir_fd, const char *path,
+                           std::span<char> buf) {
+  auto fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return {};
+  }
+  size_t len = 0;
+  while (len < buf.size()) {
+    auto ret = read(fd, buf.data() + len, buf.size() - len);
+    if (ret <= 0) {
+      break;
+    }
+    len += ret;
+  }
+  close(fd);
+  return {buf.data(), len};
+}
+
+DIR *open_proc() {
+  auto dir = opendir("/proc");
+  if (dir == nullptr) {
+    die_with_err_errno("Unable to open /proc", -1);
+  }
+  return dir;
+}
+
+} // namespace
+
+Proc_parents::Proc_parents() : time_(-1), proc_dir_(open_proc()) {}
+
+Proc_parents::~Proc_parents() { closedir(proc_dir_); }
+
+bool Proc_parents::read_ppid(pid_t pid, pid_t &ppid) {
+  char path[64];
+  snprintf(path, sizeof(path), "%d/stat", pid);
+  auto stat = read_into(dirfd(proc_dir_), path, buf_);
+  // comm can contain spaces and parentheses, field 2 starts after the last ')'
+  auto comm_end = stat.rfind(')');
+  if (comm_end == std::string_view::npos) {
+    return false;
+  }
+  const char *p = stat.data() + comm_end + 1;
+  const char *end = stat.data() + stat.size();
+  if (!skip_fields(p, end, 2, STAT_PPID_FIELD)) {
+    return false;
+  }
+  ppid = static_cast<pid_t>(parse_u64(p, end));
+  return true;
+}
+
+void Proc_parents::scan(int64_t time) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (time == time_) {
+    return;
+  }
+  parents_.clear();
+  rewinddir(proc_dir_);
+  while (auto dirent = readdir(proc_dir_)) {
+    if (dirent->d_name[0] < '0' || dirent->d_name[0] > '9') {
+      continue;
+    }
+    auto pid = static_cast<pid_t>(strtol(dirent->d_name, nullptr, 10));
+    pid_t ppid;
+    if (read_ppid(pid, ppid)) {
+      parents_.emplace_back(ppid, pid);
+    }
+  }
+  std::sort(parents_.begin(), parents_.end());
+  time_ = time;
+}
+
+void Proc_parents::append_children(pid_t pid, std::vector<pid_t> &pids) const {
+  auto [first, last] = std::equal_range(
+      parents_.begin(), parents_.end(), std::pair<pid_t, pid_t>{pid, 0},
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  for (auto i = first; i != last; ++i) {
+    pids.push_back(i->second);
+  }
+}
+
+Proc_sampler::Proc_sampler(std::chrono::microseconds full_interval,
+                           Proc_parents &parents)
+    : proc_dir_(open_proc()), page_kb_(sysconf(_SC_PAGESIZE) / 1024),
+      tick_us_(1000000 / sysconf(_SC_CLK_TCK)), full_interval_(full_interval),
+      time_(0), last_full_(0), full_pass_(true), pass_(0), scanned_(false),
+      parents_(parents) {
+  char path[64];
+  snprintf(path, sizeof(path), "%d/task/%d/children", getpid(), getpid());
+  walk_children_ = faccessat(dirfd(proc_dir_), path, R_OK, 0) == 0;
+}
+
+Proc_sampler::~Proc_sampler() { closedir(proc_dir_); }
+
+std::string_view Proc_sampler::read_proc_file(pid_t pid, const char *name) {
+  char path[64];
+  snprintf(path, sizeof(path), "%d/%s", pid, name);
+  return read_file(dirfd(proc_dir_), path);
+}
+
+std::string_view Proc_sampler::read_file(int dir_fd, const char *path) {
+  return read_into(dir_fd, path, buf_);
+}
+
+bool Proc_sampler::read_pids(int dir_fd, const char *path,
+                             std::vector<pid_t> &pids) {
+  auto fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  // May not fit in buf_ in one go, so parse it a character at a time
+  pid_t pid = 0;
+  bool in_pid = false;
+  ssize_t ret;
+  while ((ret = read(fd, buf_.data(), buf_.size())) > 0) {
+    for (const auto c : std::string_view{buf_.data(), size_t(ret)}) {
+      if (c >= '0' && c <= '9') {
+        pid = pid * 10 + (c - '0');
+        in_pid = true;
+      } else if (in_pid) {
+        pids.push_back(pid);
+        pid = 0;
+        in_pid = false;
       }
-      if (line.starts_with("Shared_Dirty:")) {
-        data.shared += parse_smaps_line(line);
+    }
+  }
+  if (in_pid) {
+    pids.push_back(pid);
+  }
+  close(fd);
+  return true;
+}
+
+void Proc_sampler::list_tasks(pid_t pid, std::vector<pid_t> &tids) {
+  tids.clear();
+  char path[64];
+  snprintf(path, sizeof(path), "%d/task", pid);
+  auto fd =
+      openat(dirfd(proc_dir_), path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  long ret;
+  while ((ret = syscall(SYS_getdents64, fd, buf_.data(), buf_.size())) > 0) {
+    for (long pos = 0; pos < ret;) {
+      auto dirent = reinterpret_cast<linux_dirent64 *>(buf_.data() + pos);
+      if (dirent->d_name[0] >= '0' && dirent->d_name[0] <= '9') {
+        tids.push_back(static_cast<pid_t>(strtol(dirent->d_name, nullptr, 10)));
       }
-      if (line.starts_with("Swap:")) {
-        data.swap += parse_smaps_line(line);
+      pos += dirent->d_reclen;
+    }
+  }
+  close(fd);
+}
+
+void Proc_sampler::read_smaps(pid_t pid, proc_cache &entry) {
+  auto smaps = read_proc_file(pid, "smaps_rollup");
+  entry.pss = find_field(smaps, "Pss:");
+  entry.shared =
+      find_field(smaps, "Shared_Clean:") + find_field(smaps, "Shared_Dirty:");
+  entry.swap_pss = find_field(smaps, "SwapPss:");
+}
+
+void Proc_sampler::start_pass(int64_t time) {
+  time_ = time;
+  full_pass_ = time - last_full_ >= full_interval_.count();
+  if (full_pass_) {
+    last_full_ = time;
+  }
+  scanned_ = false;
+  ++pass_;
+}
+
+void Proc_sampler::end_pass() {
+  std::erase_if(procs_,
+                [this](const auto &kv) { return kv.second.pass != pass_; });
+  std::erase_if(jobs_,
+                [this](const auto &kv) { return kv.second.pass != pass_; });
+}
+
+void Proc_sampler::sample_job(const job_procs_t &job, mem_data &data,
+                              std::vector<pid_t> &pids) {
+  const auto &[jobid, pid, cgroup, slots] = job;
+  if (cgroup) {
+    // The job's processes are all in its cgroup, however they were started
+    if (!sample_cgroup(cgroup.value(), data, pids)) {
+      pids.assign(1, pid);
+      cgroup_pids(cgroup.value(), pids);
+      for (const auto j_pid : pids) {
+        sample(j_pid, data, j_pid == pid);
       }
-      if (line.starts_with("SwapPss:")) {
-        data.swap_pss += parse_smaps_line(line);
+    }
+  } else {
+    // Gather all subprocesses of <jobids> tsp instance
+    pids.assign(1, pid);
+    for (auto i_pid = 0ul; i_pid < pids.size(); ++i_pid) {
+      if (sample(pids[i_pid], data, i_pid == 0)) {
+        append_children(pids[i_pid], pids);
       }
     }
   }
-  return;
-}
-
-std::pair<pid_t, uint64_t> get_ppid_and_vmem(std::string stat_line) {
-  // ppid is the 4th entry in the stat file
-  std::pair<pid_t, uint64_t> out;
-  std::string seg;
-  std::stringstream ss(stat_line);
-  for (int i = 0; i <= STAT_VSZ_FIELD; ++i) {
-    std::getline(ss, seg, ' ');
-    if (i == STAT_PPID_FIELD) {
-      try {
-        out.first = static_cast<pid_t>(std::stol(seg));
-      } catch (const std::exception &e) {
-        std::cerr << e.what() << '\n'
-                  << "Error reading ppid" << seg << " from " << stat_line
-                  << " from /proc/<pid>/stat" << std::endl;
-        return {-1, 0};
+  set_rates(slots, data);
+}
+
+void Proc_sampler::set_rates(int32_t slots, mem_data &data) {
+  auto [it, inserted] = jobs_.try_emplace(data.jobid);
+  auto &last = it->second;
+  if (!inserted && time_ > last.time) {
+    auto seconds = (time_ - last.time) / 1e6;
+    // Totals drop if a process exits without anything in the job waiting
+    // for it, there's no telling what it used in between
+    if (data.cpu_time >= last.cpu_time) {
+      data.cpu_util = (data.cpu_time - last.cpu_time) / 1e6 / seconds /
+                      std::max(slots, 1);
+    }
+    if (data.read_bytes >= last.read_bytes) {
+      data.read_rate = (data.read_bytes - last.read_bytes) / seconds;
+    }
+    if (data.write_bytes >= last.write_bytes) {
+      data.write_rate = (data.write_bytes - last.write_bytes) / seconds;
+    }
+  }
+  last = {time_, data.cpu_time, data.read_bytes, data.write_bytes, pass_};
+}
+
+bool Proc_sampler::sample(pid_t pid, mem_data &data, bool root) {
+  auto stat = read_proc_file(pid, "stat");
+  // comm can contain spaces and parentheses, field 2 starts after the last ')'
+  auto comm_end = stat.rfind(')');
+  if (comm_end == std::string_view::npos) {
+    procs_.erase(pid);
+    return false;
+  }
+  const char *p = stat.data() + comm_end + 1;
+  const char *end = stat.data() + stat.size();
+  if (!skip_fields(p, end, 2, STAT_UTIME_FIELD)) {
+    procs_.erase(pid);
+    return false;
+  }
+  // utime + stime + cutime + cstime, in clock ticks. The root's children
+  // include every job it has waited for.
+  uint64_t ticks = 0;
+  for (int i = 0; i < 4; ++i) {
+    auto field = parse_u64(p, end);
+    if (i < 2 || !root) {
+      ticks += field;
+    }
+  }
+  data.cpu_time += ticks * tick_us_;
+  if (skip_fields(p, end, STAT_UTIME_FIELD + 4, STAT_VSIZE_FIELD)) {
+    data.vmem += parse_u64(p, end);
+    data.rss += parse_u64(p, end) * page_kb_;
+  }
+
+  auto [it, inserted] = procs_.try_emplace(pid);
+  auto &entry = it->second;
+  auto status = read_proc_file(pid, "status");
+  data.swap += find_field(status, "VmSwap:");
+  data.vol_ctxt += find_field(status, "voluntary_ctxt_switches:");
+  data.invol_ctxt += find_field(status, "nonvoluntary_ctxt_switches:");
+  auto threads = find_field(status, "Threads:");
+  data.threads += threads;
+  if (inserted || full_pass_ || threads != entry.threads) {
+    entry.tids_valid = false;
+  }
+  entry.threads = threads;
+
+  if (inserted || full_pass_) {
+    read_smaps(pid, entry);
+  }
+  entry.pass = pass_;
+  data.pss += entry.pss;
+  data.shared += entry.shared;
+  data.swap_pss += entry.swap_pss;
+
+  // Only readable by the owner of the process. Includes waited for
+  // children, with no way to tell them apart, so skip the root.
+  if (!root) {
+    auto io = read_proc_file(pid, "io");
+    data.read_bytes += find_field(io, "read_bytes:");
+    data.write_bytes += find_field(io, "write_bytes:");
+  }
+  return true;
+}
+
+void Proc_sampler::append_children(pid_t pid, std::vector<pid_t> &pids) {
+  if (!walk_children_) {
+    if (!scanned_) {
+      parents_.scan(time_);
+      scanned_ = true;
+    }
+    parents_.append_children(pid, pids);
+    return;
+  }
+  auto it = procs_.find(pid);
+  if (it == procs_.end()) {
+    return;
+  }
+  auto &entry = it->second;
+  // Children are listed against the thread that started them
+  auto listed = !entry.tids_valid;
+  if (listed) {
+    if (entry.threads == 1) {
+      entry.tids.assign(1, pid);
+    } else {
+      list_tasks(pid, entry.tids);
+    }
+    entry.tids_valid = true;
+  }
+  // False if a thread in the list has exited
+  auto read_children = [&]() {
+    auto all_found = true;
+    char path[64];
+    for (const auto tid : entry.tids) {
+      snprintf(path, sizeof(path), "%d/task/%d/children", pid, tid);
+      if (!read_pids(dirfd(proc_dir_), path, pids) && errno == ENOENT) {
+        all_found = false;
       }
     }
+    return all_found;
+  };
+  auto n_pids = pids.size();
+  if (!read_children() && !listed) {
+    // Others may have started without changing the thread count, so
+    // start again from a new list
+    pids.resize(n_pids);
+    list_tasks(pid, entry.tids);
+    read_children();
   }
-  try {
-    out.second = std::stoull(seg);
-  } catch (const std::exception &e) {
-    std::cerr << e.what() << '\n'
-              << "Error reading vmem" << seg << " from " << stat_line
-              << " from /proc/<pid>/stat" << std::endl;
-    return {-1, 0};
+}
+
+bool Proc_sampler::sample_cgroup(const std::string &cgroup, mem_data &data,
+                                 std::vector<pid_t> &pids) {
+  // Without the memory or io controllers the job's processes have to be
+  // read one by one
+  path_.assign(cgroup).append("/memory.stat");
+  auto stat = read_file(AT_FDCWD, path_.c_str());
+  path_.assign(cgroup).append("/io.stat");
+  auto io_stat = read_file(AT_FDCWD, path_.c_str());
+  if (stat.empty() || access(path_.c_str(), F_OK) != 0) {
+    return false;
+  }
+  // In bytes. A page is only charged to one cgroup, so the job's resident
+  // memory is also its proportional share.
+  auto rss = (find_field(stat, "anon ") + find_field(stat, "file_mapped ")) /
+             1024;
+  data.rss += rss;
+  data.pss += rss;
+  data.shared += find_field(stat, "shmem ") / 1024;
+
+  path_.assign(cgroup).append("/memory.swap.current");
+  auto swap_current = read_file(AT_FDCWD, path_.c_str());
+  const char *p = swap_current.data();
+  auto swap = parse_u64(p, p + swap_current.size()) / 1024;
+  data.swap += swap;
+  data.swap_pss += swap;
+
+  // Includes processes that have finished, in microseconds
+  path_.assign(cgroup).append("/cpu.stat");
+  data.cpu_time +=
+      find_field(read_file(AT_FDCWD, path_.c_str()), "usage_usec ");
+  data.read_bytes += sum_field(io_stat, "rbytes=");
+  data.write_bytes += sum_field(io_stat, "wbytes=");
+  path_.assign(cgroup).append("/cgroup.threads");
+  pids.clear();
+  read_pids(AT_FDCWD, path_.c_str(), pids);
+  data.threads += pids.size();
+  return true;
+}
+
+void Proc_sampler::cgroup_pids(const std::string &cgroup,
+                               std::vector<pid_t> &pids) {
+  path_.assign(cgroup).append("/cgroup.procs");
+  read_pids(AT_FDCWD, path_.c_str(), pids);
+}
+
+Sampler_pool::Sampler_pool(int32_t nthreads,
+                           std::chrono::microseconds full_interval)
+    : generation_(0), pending_(0), stop_(false), time_(0), jobs_(nullptr),
+      out_(nullptr) {
+  nthreads = std::max(nthreads, 1);
+  for (int32_t i = 0; i < nthreads; ++i) {
+    samplers_.push_back(
+        std::make_unique<Proc_sampler>(full_interval, parents_));
+  }
+  pids_.resize(nthreads);
+  // This thread takes the first share itself
+  for (int32_t i = 1; i < nthreads; ++i) {
+    threads_.emplace_back(&Sampler_pool::run, this, i);
   }
-  return out;
 }
 
-pid_map_t get_pid_map() {
+Sampler_pool::~Sampler_pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &t : threads_) {
+    t.join();
+  }
+}
 
-  pid_map_t out;
-  std::vector<std::string> exclude{{"self"}, {"thread-self"}};
+void Sampler_pool::sample(int64_t time, const std::vector<job_procs_t> &jobs,
+                          std::vector<mem_data> &out) {
+  out.clear();
+  for (const auto &job : jobs) {
+    out.emplace_back(std::get<0>(job));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    time_ = time;
+    jobs_ = &jobs;
+    out_ = &out;
+    pending_ = threads_.size();
+    ++generation_;
+  }
+  work_cv_.notify_all();
+  sample_share(0);
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return pending_ == 0; });
+}
 
-  std::string line;
-  for (auto const &dirent : std::filesystem::directory_iterator("/proc")) {
-    if (dirent.is_directory()) {
-      if (std::find(exclude.begin(), exclude.end(),
-                    dirent.path().filename().string()) != exclude.end()) {
-        continue;
-      }
-      auto stat_file_path = dirent.path() / "stat";
-      if (std::filesystem::is_regular_file(stat_file_path)) {
-        pid_t pid;
-        try {
-          pid = std::stol(dirent.path().filename().string());
-        } catch (const std::exception &e) {
-          std::cerr << e.what() << '\n'
-                    << "Looks like " << dirent.path().filename()
-                    << "needs to be added to the /proc path exclusions list"
-                    << std::endl;
-        }
-        std::ifstream stat_file(stat_file_path);
-        if (stat_file.is_open()) {
-          std::getline(stat_file, line);
-          auto ppid = get_ppid_and_vmem(line);
-          if (ppid.first != -1) {
-            out[ppid.first].push_back({pid, ppid.second});
-          }
-        }
+void Sampler_pool::run(size_t idx) {
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_) {
+        return;
       }
+      seen = generation_;
+    }
+    sample_share(idx);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--pending_ == 0) {
+      done_cv_.notify_one();
     }
   }
-  return out;
 }
 
-} // namespace tsp
\ No newline at end of file
+void Sampler_pool::sample_share(size_t idx) {
+  auto &sampler = *samplers_[idx];
+  sampler.start_pass(time_);
+  for (size_t i = 0; i < jobs_->size(); ++i) {
+    if (std::get<0>((*jobs_)[i]) % samplers_.size() == idx) {
+      sampler.sample_job((*jobs_)[i], (*out_)[i], pids_[idx]);
+    }
+  }
+  sampler.end_pass();
+}
+
+} // namespace tsp
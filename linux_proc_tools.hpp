@@ -1,10 +1,21 @@
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
-#include <map>
+#include <dirent.h>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <sys/types.h>
+#include <thread>
+#include <tuple>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace tsp {
@@ -17,19 +28,178 @@ struct mem_data {
   uint64_t shared;
   uint64_t swap;
   uint64_t swap_pss;
+  // Totals since the job started. cpu_time is in microseconds, and the
+  // context switches are those of each process's main thread.
+  uint64_t cpu_time;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+  uint64_t vol_ctxt;
+  uint64_t invol_ctxt;
+  uint64_t threads;
+  // Since the job's previous sample, unset on its first. cpu_util is CPU
+  // time over wall time per allocated slot, the rates are bytes/s.
+  std::optional<double> cpu_util;
+  std::optional<double> read_rate;
+  std::optional<double> write_rate;
 
   mem_data(uint32_t jobid)
       : jobid(jobid), vmem(0ull), rss(0ull), pss(0ull), shared(0ull),
-        swap(0ull), swap_pss(0ull) {}
+        swap(0ull), swap_pss(0ull), cpu_time(0ull), read_bytes(0ull),
+        write_bytes(0ull), vol_ctxt(0ull), invol_ctxt(0ull), threads(0ull) {}
 };
 
-typedef std::map<pid_t, std::vector<std::pair<pid_t, uint64_t>>> pid_map_t;
+// Job id, pid of its tsp process, its cgroup, if it has one, and the
+// number of slots it was allocated
+typedef std::tuple<uint32_t, pid_t, std::optional<std::string>, int32_t>
+    job_procs_t;
 
 constexpr int STAT_PPID_FIELD = 3;
-constexpr int STAT_VSZ_FIELD = 22;
+// utime, stime, cutime and cstime follow on from here
+constexpr int STAT_UTIME_FIELD = 13;
+// vsize, in bytes, then rss, in pages
+constexpr int STAT_VSIZE_FIELD = 22;
 
-void parse_smaps(pid_t pid, mem_data &data);
-std::pair<pid_t, uint64_t> get_ppid_and_vmem(std::string);
-pid_map_t get_pid_map();
+// The parent of every process on the node, for kernels built without
+// CONFIG_PROC_CHILDREN. Shared by all the samplers of a pool, whichever
+// needs it first in a pass does the scan.
+class Proc_parents {
+public:
+  Proc_parents();
+  ~Proc_parents();
+  Proc_parents(const Proc_parents &) = delete;
+  Proc_parents &operator=(const Proc_parents &) = delete;
+  // Does nothing if the scan for the pass at time has already been done
+  void scan(int64_t time);
+  void append_children(pid_t pid, std::vector<pid_t> &pids) const;
+
+private:
+  std::mutex mutex_;
+  int64_t time_;
+  DIR *proc_dir_;
+  std::array<char, 1024> buf_;
+  // (ppid,pid), sorted
+  std::vector<std::pair<pid_t, pid_t>> parents_;
+  bool read_ppid(pid_t pid, pid_t &ppid);
+};
+
+// Reads resource usage out of /proc without allocating once warmed up.
+// vmem, rss and CPU time come from stat, swap, threads and context
+// switches from status and I/O from io on every pass. The CPU time and
+// I/O of a process include those of the children it has waited for, so
+// the totals for a job don't drop as its processes finish.
+// smaps_rollup makes the kernel walk the page tables of the whole process,
+// so pss, shared and swap_pss are only read from it every full_interval,
+// and the first time a process is seen. In between, the last values read
+// for that process are reused.
+//
+// Job process trees are found by following /proc/<pid>/task/<tid>/children
+// down from the job, so the cost of a pass depends on the number of job
+// processes rather than the number on the node. The thread ids of each
+// process are cached, and only listed again when its thread count changes
+// or on a full pass. Kernels built without CONFIG_PROC_CHILDREN fall back
+// to a Proc_parents scan.
+class Proc_sampler {
+public:
+  Proc_sampler(std::chrono::microseconds full_interval, Proc_parents &parents);
+  ~Proc_sampler();
+  Proc_sampler(const Proc_sampler &) = delete;
+  Proc_sampler &operator=(const Proc_sampler &) = delete;
+  void start_pass(int64_t time);
+  // Forgets processes not sampled in this pass
+  void end_pass();
+  // Adds up every process of the job into data, and works out its rates
+  // since the last pass. pids is scratch space.
+  void sample_job(const job_procs_t &job, mem_data &data,
+                  std::vector<pid_t> &pids);
+  // Returns false if the process has gone. A job's root is its tsp
+  // instance, which may have run earlier jobs, so only the CPU time it
+  // used itself is counted and its I/O is left out.
+  bool sample(pid_t pid, mem_data &data, bool root = false);
+  // Appends the children of pid to pids. pid must have been sampled in
+  // this pass.
+  void append_children(pid_t pid, std::vector<pid_t> &pids);
+  // Reads a job's usage from its cgroup with a few file reads, however
+  // many processes it has. Returns false if the cgroup has no memory
+  // controller. vmem and context switches are not recorded, and I/O only
+  // with the io controller. pids is scratch space.
+  bool sample_cgroup(const std::string &cgroup, mem_data &data,
+                     std::vector<pid_t> &pids);
+  // Appends the pids in cgroup to pids
+  void cgroup_pids(const std::string &cgroup, std::vector<pid_t> &pids);
+
+private:
+  struct proc_cache {
+    uint64_t pss;
+    uint64_t shared;
+    uint64_t swap_pss;
+    uint64_t threads;
+    std::vector<pid_t> tids;
+    bool tids_valid;
+    uint64_t pass;
+  };
+  struct job_cache {
+    int64_t time;
+    uint64_t cpu_time;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t pass;
+  };
+  DIR *proc_dir_;
+  uint64_t page_kb_;
+  uint64_t tick_us_;
+  std::chrono::microseconds full_interval_;
+  int64_t time_;
+  int64_t last_full_;
+  bool full_pass_;
+  uint64_t pass_;
+  bool walk_children_;
+  bool scanned_;
+  Proc_parents &parents_;
+  std::array<char, 4096> buf_;
+  std::string path_;
+  std::unordered_map<pid_t, proc_cache> procs_;
+  std::unordered_map<uint32_t, job_cache> jobs_;
+  std::string_view read_file(int dir_fd, const char *path);
+  std::string_view read_proc_file(pid_t pid, const char *name);
+  // Appends every number in the file to pids, for files of any size.
+  // Returns false with errno set if the file can't be opened.
+  bool read_pids(int dir_fd, const char *path, std::vector<pid_t> &pids);
+  void list_tasks(pid_t pid, std::vector<pid_t> &tids);
+  void read_smaps(pid_t pid, proc_cache &entry);
+  void set_rates(int32_t slots, mem_data &data);
+};
+
+// Samples the jobs of each pass across nthreads threads, the calling
+// thread being one of them. Every thread has a Proc_sampler of its own and
+// a job always goes to the same thread, so the values that thread has
+// cached for the job's processes stay useful. Each job is only written by
+// its thread, so there is nothing to merge afterwards.
+class Sampler_pool {
+public:
+  Sampler_pool(int32_t nthreads, std::chrono::microseconds full_interval);
+  ~Sampler_pool();
+  Sampler_pool(const Sampler_pool &) = delete;
+  Sampler_pool &operator=(const Sampler_pool &) = delete;
+  // Replaces the contents of out with one entry per job, in order
+  void sample(int64_t time, const std::vector<job_procs_t> &jobs,
+              std::vector<mem_data> &out);
+
+private:
+  Proc_parents parents_;
+  std::vector<std::unique_ptr<Proc_sampler>> samplers_;
+  std::vector<std::vector<pid_t>> pids_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  uint64_t generation_;
+  size_t pending_;
+  bool stop_;
+  int64_t time_;
+  const std::vector<job_procs_t> *jobs_;
+  std::vector<mem_data> *out_;
+  void run(size_t idx);
+  void sample_share(size_t idx);
+};
 
 } // namespace tsp
@@ -1,19 +1,29 @@
 #include "memprof.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdint>
 #include <sys/types.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
 #include "functions.hpp"
 #include "linux_proc_tools.hpp"
 #include "memprof_manager.hpp"
+#include "proc_affinity.hpp"
 
 namespace tsp {
 
 Memprof_config::Memprof_config() {
   bool_vars = {{"verbose", false}, {"do_fork", true}},
-  int_vars = {{"polling_interval", 10}, {"idle_timeout", 30}};
+  int_vars = {{"polling_interval_ms", 10000},
+              {"idle_timeout", 30},
+              {"smaps_interval", 60},
+              {"threads", 1},
+              {"raw_keep", 3600},
+              {"rollup_period", 60},
+              {"rollup_keep", 7 * 24 * 3600}};
 }
 
 int do_memprof(Memprof_config conf) {
@@ -31,14 +41,24 @@ int do_memprof(Memprof_config conf) {
 
   auto last_idle = now();
   auto stat = tsp::Memprof_Manager();
+  stat.set_retention(conf.get_int("raw_keep") * 1000000ll,
+                     conf.get_int("rollup_period") * 1000000ll,
+                     conf.get_int("rollup_keep") * 1000000ll);
+  auto pool =
+      Sampler_pool(conf.get_int("threads"),
+                   std::chrono::seconds(conf.get_int("smaps_interval")));
+  // Keep off the cores that jobs are bound to
+  auto binder = Proc_affinity{stat, 0, getpid(), Smt::use};
+  std::vector<uint32_t> slots_in_use;
 
   auto polling_interval =
-      std::chrono::seconds(conf.get_int("polling_interval"));
+      std::chrono::milliseconds(conf.get_int("polling_interval_ms"));
   auto idle_timeout =
       std::chrono::duration_cast<std::chrono::microseconds>(
           std::chrono::seconds(conf.get_int("idle_timeout")) + polling_interval)
           .count();
 
+  std::vector<mem_data> to_store;
   for (;;) {
     auto interval_start_time = now();
     auto running_procs = stat.get_running_job_ids_and_pids();
@@ -54,32 +74,30 @@ int do_memprof(Memprof_config conf) {
         }
         exit(EXIT_SUCCESS);
       }
-      std::vector<mem_data> to_store;
-
     } else {
       last_idle = interval_start_time;
-      auto pid_map = get_pid_map();
-      std::vector<mem_data> to_store;
-
-      for (const auto &[jobid, pid] : running_procs) {
-        if (conf.get_bool("verbose")) {
+      if (binder.error_string.empty()) {
+        auto in_use = stat.get_slots_in_use();
+        std::sort(in_use.begin(), in_use.end());
+        if (in_use != slots_in_use) {
+          slots_in_use = in_use;
+          binder.bind_outside(slots_in_use);
+        }
+      }
+      if (conf.get_bool("verbose")) {
+        for (const auto &[jobid, pid, cgroup, slots] : running_procs) {
           std::cout << "Checking job " << jobid << "\nPid: " << pid
                     << std::endl;
         }
-        // Gather all subprocesses of <jobids> tsp instance
-        to_store.emplace_back(jobid);
-        std::vector<pid_t> pids{pid};
-        for (auto i_pid = 0ul; i_pid < pids.size(); ++i_pid) {
-          if (pid_map.contains(pids[i_pid])) {
-            for (const auto &[j_pid, vmem] : pid_map[pids[i_pid]]) {
-              pids.push_back(j_pid);
-              to_store.back().vmem += vmem;
-            }
-          }
-          parse_smaps(pids[i_pid], to_store.back());
-        }
       }
+      pool.sample(interval_start_time, running_procs, to_store);
       stat.memprof_update(interval_start_time, to_store);
+      stat.memprof_compact(interval_start_time);
+      if (conf.get_bool("verbose")) {
+        std::cout << "Sampled " << running_procs.size() << " jobs in "
+                  << (now() - interval_start_time) / 1000 << " ms"
+                  << std::endl;
+      }
     }
     std::this_thread::sleep_for(
         polling_interval -
@@ -1,45 +1,160 @@
 #include "memprof_manager.hpp"
 
 #include <cstdint>
+#include <format>
+#include <optional>
 #include <sqlite3.h>
+#include <string>
+#include <string_view>
 #include <sys/types.h>
+#include <tuple>
 #include <unistd.h>
 #include <utility>
 #include <vector>
 
+#include "functions.hpp"
 #include "sqlite_statement_manager.hpp"
 
 namespace tsp {
 
 Memprof_Manager::Memprof_Manager() : Status_Manager() {
+  auto memprof_fn = get_tmp() / memprof_db_name;
   int sqlite_ret;
   char *sqlite_err;
-  if ((sqlite_ret = sqlite3_exec(conn_, memprof_init.data(), nullptr, nullptr,
-                                 &sqlite_err)) != SQLITE_OK) {
-    exit_with_sqlite_err(sqlite_err, sqlite_ret, memprof_init);
+  if ((sqlite_ret = sqlite3_open_v2(memprof_fn.c_str(), &memprof_conn_,
+                                    SQLITE_OPEN_FULLMUTEX |
+                                        SQLITE_OPEN_READWRITE |
+                                        SQLITE_OPEN_CREATE,
+                                    nullptr)) != SQLITE_OK) {
+    die_with_err("Unable to open memprof database", sqlite_ret);
   }
+  if ((sqlite_ret = sqlite3_busy_timeout(memprof_conn_, 10000)) != SQLITE_OK) {
+    die_with_err("Unable to set busy timeout", sqlite_ret);
+  }
+  if ((sqlite_ret = sqlite3_exec(memprof_conn_, db_pragmas(true).c_str(),
+                                 nullptr, nullptr, &sqlite_err)) != SQLITE_OK) {
+    exit_with_sqlite_err(sqlite_err, sqlite_ret, nullptr);
+  }
+  init_memprof_schema();
+  if (Sqlite_statement_manager(conn_, stmts_, has_memprof)
+          .fetch_one<int32_t>() == 1) {
+    Sqlite_statement_manager(conn_, stmts_, attach_memprof_stmt)
+        .step(memprof_fn.string());
+    {
+      auto txn = Sqlite_transaction{conn_};
+      if ((sqlite_ret = sqlite3_exec(conn_, memprof_migrate.data(), nullptr,
+                                     nullptr, &sqlite_err)) != SQLITE_OK) {
+        exit_with_sqlite_err(sqlite_err, sqlite_ret, memprof_migrate);
+      }
+    }
+    Sqlite_statement_manager(conn_, stmts_, detach_memprof_stmt).step();
+  }
+}
+
+void Memprof_Manager::init_memprof_schema() {
+  auto version = [this]() {
+    return Sqlite_statement_manager(memprof_conn_, memprof_stmts_,
+                                    get_memprof_schema_version_stmt)
+        .fetch_one<int32_t>();
+  };
+  if (version() == memprof_schema_version) {
+    return;
+  }
+  auto txn = Sqlite_transaction{memprof_conn_};
+  auto old_version = version();
+  if (old_version == memprof_schema_version) {
+    return;
+  }
+  if (old_version > memprof_schema_version) {
+    die_with_err(std::format("Memprof database schema version {} is newer "
+                             "than this tsp supports ({})",
+                             old_version, memprof_schema_version),
+                 -1);
+  }
+  int sqlite_ret;
+  char *sqlite_err;
+  auto exec = [&](std::string_view sql) {
+    if ((sqlite_ret = sqlite3_exec(memprof_conn_, sql.data(), nullptr,
+                                   nullptr, &sqlite_err)) != SQLITE_OK) {
+      exit_with_sqlite_err(sqlite_err, sqlite_ret, nullptr);
+    }
+  };
+  if (old_version < 2) {
+    exec(memprof_init);
+    exec(memprof_summary_backfill);
+  }
+  if (old_version < 3) {
+    exec(memprof_add_usage);
+  }
+  exec(memprof_summary_trigger);
+  exec(std::format("PRAGMA user_version = {};", memprof_schema_version));
 }
 
-void Memprof_Manager::memprof_update(int64_t time, std::vector<mem_data> data) {
+Memprof_Manager::~Memprof_Manager() {
+  memprof_stmts_.clear();
+  sqlite3_close_v2(memprof_conn_);
+}
+
+void Memprof_Manager::memprof_update(int64_t time,
+                                     const std::vector<mem_data> &data) {
   if (!rw_) {
     die_with_err("Attempted to write to database in read-only mode!", -1);
   }
-  auto ssm = Sqlite_statement_manager(conn_, insert_memprof_data);
+  // A sync per interval rather than per job
+  auto txn = Sqlite_transaction{memprof_conn_};
+  auto ssm = Sqlite_statement_manager(memprof_conn_, memprof_stmts_,
+                                      insert_memprof_data);
   for (const auto &proc : data) {
     ssm.step(time, proc.jobid, proc.vmem, proc.rss, proc.pss, proc.shared,
-             proc.swap, proc.swap_pss);
+             proc.swap, proc.swap_pss, proc.cpu_time, proc.read_bytes,
+             proc.write_bytes, proc.vol_ctxt, proc.invol_ctxt, proc.threads,
+             proc.cpu_util, proc.read_rate, proc.write_rate);
+  }
+}
+
+void Memprof_Manager::set_retention(int64_t raw_keep, int64_t rollup_period,
+                                    int64_t rollup_keep) {
+  if (rollup_period <= 0) {
+    die_with_err("Memory profile rollup period must be positive", -1);
+  }
+  raw_keep_ = raw_keep;
+  rollup_period_ = rollup_period;
+  rollup_keep_ = rollup_keep;
+  compacted_to_ = 0;
+}
+
+void Memprof_Manager::memprof_compact(int64_t time) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto cutoff = (time - raw_keep_) / rollup_period_ * rollup_period_;
+  if (cutoff <= compacted_to_) {
+    return;
+  }
+  auto txn = Sqlite_transaction{memprof_conn_};
+  Sqlite_statement_manager(memprof_conn_, memprof_stmts_, rollup_memprof_stmt)
+      .step(cutoff, rollup_period_);
+  Sqlite_statement_manager(memprof_conn_, memprof_stmts_,
+                           delete_old_memprof_stmt)
+      .step(cutoff);
+  if (rollup_keep_ > 0) {
+    Sqlite_statement_manager(memprof_conn_, memprof_stmts_,
+                             expire_memprof_rollup_stmt)
+        .step(time - rollup_keep_);
   }
+  compacted_to_ = cutoff;
 }
 
-std::vector<std::pair<uint32_t, pid_t>>
+std::vector<job_procs_t>
 Memprof_Manager::get_running_job_ids_and_pids() {
   if (!conn_) {
     die_with_err("Database connection has failed", -1);
   }
-  std::vector<std::pair<uint32_t, pid_t>> out;
-  auto ssm = Sqlite_statement_manager(conn_, get_ids_and_pids);
-  while (auto t = ssm.step<uint32_t, pid_t>()) {
-    out.emplace_back(std::get<0>(t.value()), std::get<1>(t.value()));
+  std::vector<job_procs_t> out;
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, get_ids_and_pids);
+  while (auto t = ssm.step<uint32_t, pid_t, std::optional<std::string>,
+                           int32_t>()) {
+    out.push_back(std::move(t.value()));
   }
   return out;
 }
@@ -1,33 +1,194 @@
 #pragma once
 
+#include <optional>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include "linux_proc_tools.hpp"
+#include "sqlite_statement_manager.hpp"
 #include "status_manager.hpp"
 
 namespace tsp {
 
+// Lives in memprof_db_name rather than the job database. The jobs it
+// refers to are in another file, so there's no foreign key. This is the
+// layout of schema 2, memprof_add_usage brings it up to date.
 constexpr std::string_view memprof_init(
     // Create memprof table
     "CREATE TABLE IF NOT EXISTS memprof (jobid INTEGER NOT NULL, time INTEGER, "
     "vmem INTEGER, rss INTEGER, pss INTEGER, shared INTEGER, swap INTEGER, "
-    "swap_pss INTEGER, FOREIGN KEY(jobid) REFERENCES jobs(id) ON DELETE "
-    "CASCADE);");
+    "swap_pss INTEGER); "
+    "CREATE INDEX IF NOT EXISTS memprof_jobid_time ON memprof(jobid,time); "
+    // Downsampled memprof, time is the start of the period
+    "CREATE TABLE IF NOT EXISTS memprof_rollup (jobid INTEGER NOT NULL, time "
+    "INTEGER, samples INTEGER, min_vmem INTEGER, max_vmem INTEGER, mean_vmem "
+    "REAL, min_rss INTEGER, max_rss INTEGER, mean_rss REAL, min_pss INTEGER, "
+    "max_pss INTEGER, mean_pss REAL, min_shared INTEGER, max_shared INTEGER, "
+    "mean_shared REAL, min_swap INTEGER, max_swap INTEGER, mean_swap REAL, "
+    "min_swap_pss INTEGER, max_swap_pss INTEGER, mean_swap_pss REAL); "
+    "CREATE INDEX IF NOT EXISTS memprof_rollup_jobid_time ON "
+    "memprof_rollup(jobid,time); "
+    // One row per job, kept up to date by memprof_summary_trigger, so that
+    // summary queries don't have to read every sample. The mean is
+    // sum / samples.
+    "CREATE TABLE IF NOT EXISTS memprof_summary (jobid INTEGER PRIMARY KEY, "
+    "samples INTEGER, last_time INTEGER, max_vmem INTEGER, max_rss INTEGER, "
+    "max_pss INTEGER, max_shared INTEGER, max_swap INTEGER, max_swap_pss "
+    "INTEGER, sum_rss INTEGER, sum_pss INTEGER, last_rss INTEGER, last_pss "
+    "INTEGER);");
 
-constexpr std::string_view insert_memprof_data(
-    "INSERT INTO memprof(time,jobid,vmem,rss,pss,shared,swap,swap_pss) "
-    "VALUES (?,?,?,?,?,?,?,?);");
+// Summaries for samples recorded before there was a summary table
+constexpr std::string_view memprof_summary_backfill(
+    "INSERT OR REPLACE INTO memprof_summary(jobid,samples,last_time,"
+    "max_vmem,max_rss,max_pss,max_shared,max_swap,max_swap_pss,sum_rss,"
+    "sum_pss,last_rss,last_pss) SELECT jobid,COUNT(*),MAX(time),"
+    "MAX(vmem),MAX(rss),MAX(pss),MAX(shared),MAX(swap),MAX(swap_pss),"
+    "SUM(rss),SUM(pss),( SELECT rss FROM memprof AS latest WHERE latest.jobid "
+    "= memprof.jobid ORDER BY time DESC LIMIT 1 ),( SELECT pss FROM memprof AS "
+    "latest WHERE latest.jobid = memprof.jobid ORDER BY time DESC LIMIT 1 ) "
+    "FROM memprof GROUP BY jobid;");
+
+// Schema 3 records CPU, I/O and threads alongside memory. Totals are as
+// at the last sample, or the end of the rollup period.
+constexpr std::string_view memprof_add_usage(
+    "ALTER TABLE memprof ADD COLUMN cpu_time INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof ADD COLUMN read_bytes INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof ADD COLUMN write_bytes INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof ADD COLUMN vol_ctxt INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof ADD COLUMN invol_ctxt INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof ADD COLUMN threads INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof ADD COLUMN cpu_util REAL;"
+    "ALTER TABLE memprof ADD COLUMN read_rate REAL;"
+    "ALTER TABLE memprof ADD COLUMN write_rate REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN cpu_time INTEGER;"
+    "ALTER TABLE memprof_rollup ADD COLUMN read_bytes INTEGER;"
+    "ALTER TABLE memprof_rollup ADD COLUMN write_bytes INTEGER;"
+    "ALTER TABLE memprof_rollup ADD COLUMN vol_ctxt INTEGER;"
+    "ALTER TABLE memprof_rollup ADD COLUMN invol_ctxt INTEGER;"
+    "ALTER TABLE memprof_rollup ADD COLUMN min_threads INTEGER;"
+    "ALTER TABLE memprof_rollup ADD COLUMN max_threads INTEGER;"
+    "ALTER TABLE memprof_rollup ADD COLUMN mean_threads REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN min_cpu_util REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN max_cpu_util REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN mean_cpu_util REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN min_read_rate REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN max_read_rate REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN mean_read_rate REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN min_write_rate REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN max_write_rate REAL;"
+    "ALTER TABLE memprof_rollup ADD COLUMN mean_write_rate REAL;"
+    "ALTER TABLE memprof_summary ADD COLUMN cpu_time INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof_summary ADD COLUMN read_bytes INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof_summary ADD COLUMN write_bytes INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof_summary ADD COLUMN vol_ctxt INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof_summary ADD COLUMN invol_ctxt INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof_summary ADD COLUMN max_threads INTEGER DEFAULT 0;"
+    "ALTER TABLE memprof_summary ADD COLUMN max_cpu_util REAL;"
+    "ALTER TABLE memprof_summary ADD COLUMN max_read_rate REAL;"
+    "ALTER TABLE memprof_summary ADD COLUMN max_write_rate REAL;");
+
+// Keeps memprof_summary up to date as samples come in, recreated whenever
+// the schema changes. Rates are unset on a job's first sample, and
+// MAX() with a NULL argument is NULL, hence the COALESCEs.
+constexpr std::string_view memprof_summary_trigger(
+    "DROP TRIGGER IF EXISTS memprof_summarise; "
+    "CREATE TRIGGER memprof_summarise AFTER INSERT ON memprof BEGIN "
+    "INSERT OR IGNORE INTO memprof_summary(jobid,samples,max_vmem,max_rss,"
+    "max_pss,max_shared,max_swap,max_swap_pss,sum_rss,sum_pss) VALUES "
+    "(NEW.jobid,0,0,0,0,0,0,0,0,0); "
+    "UPDATE memprof_summary SET samples = samples + 1, last_time = NEW.time, "
+    "max_vmem = MAX(max_vmem,NEW.vmem), max_rss = MAX(max_rss,NEW.rss), "
+    "max_pss = MAX(max_pss,NEW.pss), max_shared = MAX(max_shared,NEW.shared), "
+    "max_swap = MAX(max_swap,NEW.swap), max_swap_pss = "
+    "MAX(max_swap_pss,NEW.swap_pss), sum_rss = sum_rss + NEW.rss, sum_pss = "
+    "sum_pss + NEW.pss, last_rss = NEW.rss, last_pss = NEW.pss, cpu_time = "
+    "NEW.cpu_time, read_bytes = NEW.read_bytes, write_bytes = "
+    "NEW.write_bytes, vol_ctxt = NEW.vol_ctxt, invol_ctxt = NEW.invol_ctxt, "
+    "max_threads = MAX(max_threads,NEW.threads), max_cpu_util = "
+    "COALESCE(MAX(max_cpu_util,NEW.cpu_util),max_cpu_util,NEW.cpu_util), "
+    "max_read_rate = COALESCE(MAX(max_read_rate,NEW.read_rate),max_read_rate,"
+    "NEW.read_rate), max_write_rate = COALESCE(MAX(max_write_rate,"
+    "NEW.write_rate),max_write_rate,NEW.write_rate) WHERE jobid = NEW.jobid; "
+    "END;");
+
+constexpr std::string_view get_memprof_schema_version_stmt(
+    "PRAGMA user_version;");
+
+// ?1 is the cutoff, ?2 the rollup period. The cutoff is always a multiple
+// of the period, so no period is ever split between two compactions.
+constexpr std::string_view rollup_memprof_stmt(
+    "INSERT INTO memprof_rollup(jobid,time,samples,min_vmem,max_vmem,"
+    "mean_vmem,min_rss,max_rss,mean_rss,min_pss,max_pss,mean_pss,min_shared,"
+    "max_shared,mean_shared,min_swap,max_swap,mean_swap,min_swap_pss,"
+    "max_swap_pss,mean_swap_pss,cpu_time,read_bytes,write_bytes,vol_ctxt,"
+    "invol_ctxt,min_threads,max_threads,mean_threads,min_cpu_util,"
+    "max_cpu_util,mean_cpu_util,min_read_rate,max_read_rate,mean_read_rate,"
+    "min_write_rate,max_write_rate,mean_write_rate) SELECT jobid,time / ?2 * "
+    "?2,COUNT(*),MIN(vmem),MAX(vmem),AVG(vmem),MIN(rss),MAX(rss),AVG(rss),"
+    "MIN(pss),MAX(pss),AVG(pss),MIN(shared),MAX(shared),AVG(shared),"
+    "MIN(swap),MAX(swap),AVG(swap),MIN(swap_pss),MAX(swap_pss),AVG(swap_pss),"
+    "MAX(cpu_time),MAX(read_bytes),MAX(write_bytes),MAX(vol_ctxt),"
+    "MAX(invol_ctxt),MIN(threads),MAX(threads),AVG(threads),MIN(cpu_util),"
+    "MAX(cpu_util),AVG(cpu_util),MIN(read_rate),MAX(read_rate),AVG(read_rate),"
+    "MIN(write_rate),MAX(write_rate),AVG(write_rate) FROM memprof WHERE time "
+    "< ?1 GROUP BY jobid,time / ?2;");
 
 constexpr std::string_view
-    get_ids_and_pids("SELECT id,pid FROM sibling_pids;");
+    delete_old_memprof_stmt("DELETE FROM memprof WHERE time < ?;");
+
+// Drops the rollups of jobs with no samples since ?1. Their summaries stay.
+constexpr std::string_view expire_memprof_rollup_stmt(
+    "DELETE FROM memprof_rollup WHERE jobid IN ( SELECT jobid FROM "
+    "memprof_summary WHERE last_time < ?1 );");
+
+// Moves profiles recorded by older versions of memprof out of the job
+// database, which must have memprof_db attached
+constexpr std::string_view memprof_migrate(
+    "INSERT INTO memprof_db.memprof(jobid,time,vmem,rss,pss,shared,swap,"
+    "swap_pss) SELECT jobid,time,vmem,rss,pss,shared,swap,swap_pss FROM "
+    "main.memprof; "
+    "DROP TABLE main.memprof;");
+
+constexpr std::string_view insert_memprof_data(
+    "INSERT INTO memprof(time,jobid,vmem,rss,pss,shared,swap,swap_pss,"
+    "cpu_time,read_bytes,write_bytes,vol_ctxt,invol_ctxt,threads,cpu_util,"
+    "read_rate,write_rate) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?);");
+
+constexpr std::string_view get_ids_and_pids(
+    "SELECT sibling_pids.id,sibling_pids.pid,path,slots FROM sibling_pids "
+    "JOIN jobs ON sibling_pids.id = jobs.id LEFT JOIN job_cgroup ON "
+    "sibling_pids.id = job_cgroup.jobid;");
 
 class Memprof_Manager : public Status_Manager {
 public:
   Memprof_Manager();
-  void memprof_update(int64_t time, std::vector<mem_data> data);
-  std::vector<std::pair<uint32_t, pid_t>> get_running_job_ids_and_pids();
+  ~Memprof_Manager();
+  Memprof_Manager(const Memprof_Manager &) = delete;
+  Memprof_Manager &operator=(const Memprof_Manager &) = delete;
+  // Records one interval's samples in a single transaction
+  void memprof_update(int64_t time, const std::vector<mem_data> &data);
+  // Raw samples are kept for raw_keep, then replaced by one row per job per
+  // rollup_period in memprof_rollup. Once a job has had no samples for
+  // rollup_keep, only its summary is kept. A rollup_keep of 0 keeps rollups
+  // forever. All in microseconds.
+  void set_retention(int64_t raw_keep, int64_t rollup_period,
+                     int64_t rollup_keep);
+  // Applies the retention periods above. Cheap to call every interval, it
+  // only does anything once a whole rollup period has aged out.
+  void memprof_compact(int64_t time);
+  // Job id, pid and cgroup of every running job
+  std::vector<job_procs_t> get_running_job_ids_and_pids();
+
+private:
+  sqlite3 *memprof_conn_ = nullptr;
+  Sqlite_statement_cache memprof_stmts_;
+  int64_t compacted_to_ = 0;
+  int64_t raw_keep_ = 3600ll * 1000000ll;
+  int64_t rollup_period_ = 60ll * 1000000ll;
+  int64_t rollup_keep_ = 0;
+  void init_memprof_schema();
 };
 
-} // namespace tsp
\ No newline at end of file
+} // namespace tsp
@@ -1,25 +1,54 @@
 
 #include "output_manager.hpp"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <format>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "functions.hpp"
 
 namespace tsp {
-Output_handler::Output_handler(bool disappear, bool separate_stderr,
-                               std::string jobid, bool rw)
+Output_handler::Output_handler(
+    bool disappear, bool separate_stderr, std::string jobid, bool rw,
+    std::optional<std::pair<int64_t, int64_t>> max_output)
     : stdout_fn_{get_tmp() / (std::string(out_file_template) + jobid)},
       stderr_fn_{get_tmp() / (std::string(err_file_template) + jobid)},
       stdout_fd_(-1), stderr_fd_(-1), disappear_{disappear},
-      separate_stderr_{separate_stderr} {}
+      separate_stderr_{separate_stderr} {
+  if (disappear_ || !max_output) {
+    return;
+  }
+  // The head goes straight to the output file, so that it can be followed
+  // while the job runs
+  for (const auto &fn : {stdout_fn_, stderr_fn_}) {
+    auto &c = captures_.emplace_back();
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+      die_with_err_errno("Unable to create output pipe", -1);
+    }
+    c.pipe_fd = fds[0];
+    c.child_fd = fds[1];
+    if ((c.file_fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          0600)) == -1) {
+      die_with_err_errno("Unable to open output file", -1);
+    }
+    c.head = max_output->first;
+    c.tail.resize(max_output->second);
+    if (!separate_stderr_) {
+      break;
+    }
+  }
+}
 
 Output_handler::~Output_handler() {
   if (stdout_fd_ != -1) {
@@ -28,9 +57,22 @@ Output_handler::~Output_handler() {
   if (stderr_fd_ != -1) {
     close(stderr_fd_);
   }
+  for (const auto &c : captures_) {
+    for (const auto fd : {c.pipe_fd, c.child_fd, c.file_fd}) {
+      if (fd != -1) {
+        close(fd);
+      }
+    }
+  }
 }
 
 void Output_handler::init_pipes() {
+  if (!captures_.empty()) {
+    // dup2 clears close-on-exec for the job's copies only
+    dup2(captures_.front().child_fd, 1);
+    dup2(captures_.back().child_fd, 2);
+    return;
+  }
   if (disappear_) {
     stdout_fd_ = open("/dev/null", O_WRONLY | O_CREAT, 0666);
     stderr_fd_ = open("/dev/null", O_WRONLY | O_CREAT, 0666);
@@ -47,19 +89,150 @@ void Output_handler::init_pipes() {
   dup2(stderr_fd_, 2);
 }
 
-std::pair<std::string, std::string> Output_handler::get_output() {
-  std::ifstream stdout_stream(stdout_fn_);
-  std::stringstream ss_out{};
-  ss_out << stdout_stream.rdbuf();
-  stdout_stream.close();
-  std::filesystem::remove(stdout_fn_);
+void Output_handler::start_capture() {
+  // Otherwise we'd never see end of file on the pipes
+  for (auto &c : captures_) {
+    close(c.child_fd);
+    c.child_fd = -1;
+  }
+}
 
-  std::ifstream stderr_stream(stderr_fn_);
-  std::stringstream ss_err{};
-  ss_err << stdout_stream.rdbuf();
-  stderr_stream.close();
+bool Output_handler::capturing() {
+  return std::any_of(captures_.begin(), captures_.end(),
+                     [](const auto &c) { return c.pipe_fd != -1; });
+}
+
+void Output_handler::capture(std::chrono::milliseconds timeout) {
+  std::vector<struct pollfd> pfds;
+  for (const auto &c : captures_) {
+    pfds.push_back({c.pipe_fd, POLLIN, 0});
+  }
+  if (poll(pfds.data(), pfds.size(), timeout.count()) <= 0) {
+    return;
+  }
+  char buf[65536];
+  for (size_t i = 0; i < captures_.size(); ++i) {
+    auto &c = captures_[i];
+    if (c.pipe_fd == -1 || !(pfds[i].revents & (POLLIN | POLLHUP))) {
+      continue;
+    }
+    auto len = read(c.pipe_fd, buf, sizeof(buf));
+    if (len > 0) {
+      keep(c, buf, len);
+    } else if (len == 0 || errno != EINTR) {
+      close(c.pipe_fd);
+      c.pipe_fd = -1;
+    }
+  }
+}
+
+void Output_handler::keep(capture_stream &c, const char *buf, size_t len) {
+  if (c.total < c.head) {
+    auto n = std::min<int64_t>(len, c.head - c.total);
+    if (write(c.file_fd, buf, n) != n) {
+      die_with_err_errno("Unable to write output file", -1);
+    }
+    c.total += n;
+    buf += n;
+    len -= n;
+  }
+  c.total += len;
+  auto cap = c.tail.size();
+  if (cap == 0) {
+    return;
+  }
+  if (len >= cap) {
+    buf += len - cap;
+    len = cap;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    c.tail[c.tail_pos] = buf[i];
+    c.tail_pos = (c.tail_pos + 1) % cap;
+  }
+  c.tail_len = std::min(c.tail_len + len, cap);
+}
+
+void Output_handler::finish_capture() {
+  char buf[65536];
+  for (auto &c : captures_) {
+    // Anything left behind by processes that outlived the job
+    if (c.pipe_fd != -1) {
+      fcntl(c.pipe_fd, F_SETFL, O_NONBLOCK);
+      ssize_t len;
+      while ((len = read(c.pipe_fd, buf, sizeof(buf))) > 0) {
+        keep(c, buf, len);
+      }
+      close(c.pipe_fd);
+      c.pipe_fd = -1;
+    }
+    auto kept = std::min(c.total, c.head) + static_cast<int64_t>(c.tail_len);
+    std::string marker;
+    if (c.total > kept) {
+      marker = std::format("\n[tsp: {} bytes of output omitted]\n",
+                           c.total - kept);
+    }
+    // Oldest bytes in the ring start at tail_pos once it has wrapped
+    auto start = c.tail_len < c.tail.size() ? 0 : c.tail_pos;
+    for (auto [ptr, len] : {std::pair{marker.data(), marker.size()},
+                            std::pair{c.tail.data() + start, c.tail_len - start},
+                            std::pair{c.tail.data(), start}}) {
+      if (write(c.file_fd, ptr, len) != static_cast<ssize_t>(len)) {
+        die_with_err_errno("Unable to write output file", -1);
+      }
+    }
+    close(c.file_fd);
+    c.file_fd = -1;
+  }
+}
+
+std::pair<std::filesystem::path, std::filesystem::path>
+Output_handler::output_files() {
+  return {stdout_fn_, stderr_fn_};
+}
+
+void Output_handler::remove_output_files() {
+  std::filesystem::remove(stdout_fn_);
   std::filesystem::remove(stderr_fn_);
+}
 
-  return {ss_out.str(), ss_err.str()};
+void compress_file_chunks(
+    const std::filesystem::path &fn,
+    const std::function<void(int64_t, const std::vector<unsigned char> &)>
+        &store) {
+  std::ifstream in(fn, std::ios::binary);
+  if (!in) {
+    return;
+  }
+  std::vector<char> buf(output_chunk_size);
+  std::vector<unsigned char> zbuf(compressBound(output_chunk_size));
+  while (in.read(buf.data(), buf.size()) || in.gcount() > 0) {
+    auto bytes = in.gcount();
+    auto zlen = uLongf{zbuf.size()};
+    // Job output is written once and read rarely, favour speed
+    if (auto ret = compress2(zbuf.data(), &zlen,
+                             reinterpret_cast<const Bytef *>(buf.data()),
+                             bytes, Z_BEST_SPEED);
+        ret != Z_OK) {
+      die_with_err(std::format("Unable to compress output of {}", fn.string()),
+                   ret);
+    }
+    zbuf.resize(zlen);
+    store(bytes, zbuf);
+    zbuf.resize(zbuf.capacity());
+  }
+}
+
+void decompress_chunk(int64_t bytes, const std::vector<unsigned char> &data,
+                      int64_t skip, std::ostream &out) {
+  std::vector<char> buf(bytes);
+  auto len = uLongf(bytes);
+  if (auto ret = uncompress(reinterpret_cast<Bytef *>(buf.data()), &len,
+                            data.data(), data.size());
+      ret != Z_OK) {
+    die_with_err("Stored job output is corrupt", ret);
+  }
+  if (static_cast<int64_t>(len) > skip) {
+    out.write(buf.data() + skip, len - skip);
+  }
 }
 } // namespace tsp
\ No newline at end of file
@@ -1,25 +1,74 @@
 #pragma once
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <ostream>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 constexpr std::string_view out_file_template{"tsp.o"};
 constexpr std::string_view err_file_template{"tsp.e"};
 
 namespace tsp {
+// Output is stored in the database as independently compressed chunks of
+// this many bytes, so neither storing nor printing it needs more memory
+// than a chunk or two
+constexpr size_t output_chunk_size{1 << 20};
+
+enum class OutputStream { out, err };
+
+// Calls store with the uncompressed length and compressed contents of
+// each chunk of fn. Does nothing if fn doesn't exist.
+void compress_file_chunks(
+    const std::filesystem::path &fn,
+    const std::function<void(int64_t, const std::vector<unsigned char> &)>
+        &store);
+// Writes the chunk to out, less its first skip bytes
+void decompress_chunk(int64_t bytes, const std::vector<unsigned char> &data,
+                      int64_t skip, std::ostream &out);
+
 class Output_handler {
 public:
+  // With max_output, the job writes to a pipe and only the given number of
+  // bytes from the start and end of each stream are kept
   Output_handler(bool disappear, bool separate_stderr, std::string jobid,
-                 bool rw);
+                 bool rw,
+                 std::optional<std::pair<int64_t, int64_t>> max_output);
   void init_pipes();
-  std::pair<std::string, std::string> get_output();
+  // Called in the parent once the job has been forked
+  void start_capture();
+  bool capturing();
+  // Wait up to timeout for output from the job and keep what's needed
+  void capture(std::chrono::milliseconds timeout);
+  // Read whatever is left, then write out the kept tail
+  void finish_capture();
+  std::pair<std::filesystem::path, std::filesystem::path> output_files();
+  void remove_output_files();
   ~Output_handler();
 
 private:
+  struct capture_stream {
+    int pipe_fd = -1;
+    int child_fd = -1;
+    int file_fd = -1;
+    int64_t head = 0;
+    int64_t total = 0;
+    // Ring buffer holding the most recent bytes past the head
+    std::vector<char> tail;
+    size_t tail_pos = 0;
+    size_t tail_len = 0;
+  };
   const std::string stdout_fn_{};
   const std::string stderr_fn_{};
   int stdout_fd_;
   int stderr_fd_;
   const bool disappear_;
   const bool separate_stderr_;
+  std::vector<capture_stream> captures_;
+  void keep(capture_stream &c, const char *buf, size_t len);
 };
 } // namespace tsp
\ No newline at end of file
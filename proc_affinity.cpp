@@ -1,11 +1,20 @@
 #include "proc_affinity.hpp"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstdlib>
+#include <filesystem>
 #include <format>
+#include <fstream>
+#include <functional>
 #include <hwloc.h>
+#include <iterator>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <sys/types.h>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
 #include "functions.hpp"
@@ -13,33 +22,207 @@
 
 namespace tsp {
 
-Proc_affinity::Proc_affinity(Status_Manager &sm, int32_t nslots, pid_t pid)
-    : error_string(), sm_(sm), nslots_(nslots), pid_(pid) {
+std::optional<Distribution> distribution_from_string(std::string_view in) {
+  if (in.empty() || in == "compact") {
+    return Distribution::compact;
+  } else if (in == "linear") {
+    return Distribution::linear;
+  } else if (in == "scatter") {
+    return Distribution::scatter;
+  } else if (in == "cache") {
+    return Distribution::cache;
+  }
+  return std::nullopt;
+}
 
-  if (hwloc_topology_init(&topology_) == -1) {
-    die_with_err_errno("Failed to initialise topology object", -1);
+std::string_view distribution_to_string(Distribution d) {
+  switch (d) {
+  case Distribution::linear:
+    return "linear";
+  case Distribution::compact:
+    return "compact";
+  case Distribution::scatter:
+    return "scatter";
+  case Distribution::cache:
+    return "cache";
   }
-  if (hwloc_topology_set_flags(
-          topology_, HWLOC_TOPOLOGY_FLAG_IS_THISSYSTEM |
-                         HWLOC_TOPOLOGY_FLAG_RESTRICT_TO_CPUBINDING |
-                         HWLOC_TOPOLOGY_FLAG_DONT_CHANGE_BINDING) == -1) {
-    error_string = "Failed to set topology loading flags";
-    return;
+  return "compact";
+}
+
+std::optional<Membind> membind_from_string(std::string_view in) {
+  if (in.empty() || in == "none") {
+    return Membind::none;
+  } else if (in == "bind") {
+    return Membind::bind;
+  } else if (in == "interleave") {
+    return Membind::interleave;
+  } else if (in == "preferred") {
+    return Membind::preferred;
   }
+  return std::nullopt;
+}
+
+std::string_view membind_to_string(Membind m) {
+  switch (m) {
+  case Membind::none:
+    return "none";
+  case Membind::bind:
+    return "bind";
+  case Membind::interleave:
+    return "interleave";
+  case Membind::preferred:
+    return "preferred";
+  }
+  return "none";
+}
 
-  if (hwloc_topology_load(topology_) == -1) {
-    error_string = "Failed to load topology";
+std::optional<Slot_unit> slot_unit_from_string(std::string_view in) {
+  if (in.empty() || in == "core") {
+    return Slot_unit::core;
+  } else if (in == "pu") {
+    return Slot_unit::pu;
+  }
+  return std::nullopt;
+}
+
+std::string_view slot_unit_to_string(Slot_unit u) {
+  switch (u) {
+  case Slot_unit::core:
+    return "core";
+  case Slot_unit::pu:
+    return "pu";
+  }
+  return "core";
+}
+
+std::optional<Smt> smt_from_string(std::string_view in) {
+  if (in.empty() || in == "use") {
+    return Smt::use;
+  } else if (in == "idle") {
+    return Smt::idle;
+  }
+  return std::nullopt;
+}
+
+std::string_view smt_to_string(Smt s) {
+  switch (s) {
+  case Smt::use:
+    return "use";
+  case Smt::idle:
+    return "idle";
+  }
+  return "use";
+}
+
+// Anything that changes what hwloc would discover must be part of the key
+std::filesystem::path topology_cache_file() {
+  std::string key = std::format("{}\n", HWLOC_API_VERSION);
+  char hostname[256] = {};
+  gethostname(hostname, sizeof(hostname) - 1);
+  key += hostname;
+  for (const auto var : {"HWLOC_FSROOT", "HWLOC_COMPONENTS", "HWLOC_ALLOW"}) {
+    if (auto val = std::getenv(var)) {
+      key += std::format("\n{}={}", var, val);
+    }
+  }
+#ifdef __linux__
+  for (const auto fn :
+       {"/proc/sys/kernel/random/boot_id", "/proc/self/cgroup"}) {
+    std::ifstream in{fn};
+    key += std::string{std::istreambuf_iterator<char>{in}, {}};
+  }
+  std::ifstream status{"/proc/self/status"};
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.starts_with("Cpus_allowed_list:") ||
+        line.starts_with("Mems_allowed_list:")) {
+      key += line;
+    }
+  }
+#endif
+  return get_tmp() / std::format("{}{:016x}.xml", topology_cache_template,
+                                 std::hash<std::string>{}(key));
+}
+
+// Removes the oldest cache files once there are more than
+// topology_cache_max_files, e.g. left behind by earlier boots or cgroups.
+// Only called after writing a new one, so rarely.
+void prune_topology_cache(const std::filesystem::path &keep) {
+  std::error_code ec;
+  std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>>
+      found;
+  for (const auto &entry :
+       std::filesystem::directory_iterator(keep.parent_path(), ec)) {
+    if (!entry.path().filename().string().starts_with(
+            topology_cache_template) ||
+        entry.path() == keep) {
+      continue;
+    }
+    auto mtime = entry.last_write_time(ec);
+    if (!ec) {
+      found.emplace_back(mtime, entry.path());
+    }
+  }
+  if (found.size() < topology_cache_max_files) {
     return;
   }
-  auto cgroup_size = hwloc_get_nbobjs_by_type(topology_, HWLOC_OBJ_CORE);
+  std::sort(found.begin(), found.end(), std::greater{});
+  for (auto it = found.begin() + topology_cache_max_files - 1;
+       it != found.end(); ++it) {
+    std::filesystem::remove(it->second, ec);
+  }
+}
+
+Proc_affinity::Proc_affinity(Status_Manager &sm, int32_t nslots, pid_t pid,
+                             Smt smt)
+    : error_string(), sm_(sm), membound_(false), nslots_(nslots),
+      slot_unit_(slot_unit_from_string(
+                     sm.get_node_setting(std::string{slot_unit_setting}))
+                     .value_or(Slot_unit::core)),
+      slot_type_(slot_unit_ == Slot_unit::pu ? HWLOC_OBJ_PU : HWLOC_OBJ_CORE),
+      total_slots_(0), pid_(pid) {
+
+  // Discovering the topology is the most expensive thing most tsp
+  // instances do, so reuse what an earlier instance found. Synthetic and
+  // XML topologies are already cheap to load.
+  auto use_cache = std::getenv("HWLOC_SYNTHETIC") == nullptr &&
+                   std::getenv("HWLOC_XMLFILE") == nullptr;
+  auto cache = topology_cache_file();
+  std::error_code ec;
+  auto cached = use_cache && std::filesystem::exists(cache, ec);
+  if (cached && !load_topology(cache.c_str())) {
+    hwloc_topology_destroy(topology_);
+    cached = false;
+  }
+  if (!cached) {
+    if (!load_topology(nullptr)) {
+      error_string = "Failed to load topology";
+      return;
+    }
+  }
+  if (!cached && use_cache) {
+    // Write then rename so that nobody reads a partial file
+    auto tmp = cache;
+    tmp += std::format(".{}", getpid());
+    if (hwloc_topology_export_xml(topology_, tmp.c_str(), 0) == 0) {
+      std::filesystem::rename(tmp, cache, ec);
+    }
+    std::filesystem::remove(tmp, ec);
+    prune_topology_cache(cache);
+  }
+  auto cgroup_size = hwloc_get_nbobjs_by_type(topology_, slot_type_);
   if (cgroup_size < 1) {
     error_string = "Failed to retrieve number of available CPU cores";
     return;
   }
 
+  total_slots_ = cgroup_size;
   sm_.set_total_slots(cgroup_size);
+  // Without an explicit budget, memory reservations may use all of it
+  sm_.set_node_setting_default("mem_budget", std::to_string(total_memory()));
+  build_domains();
 
-  if (nslots > cgroup_size) {
+  if (nslots > capacity(smt)) {
     error_string = "More slots requested than available on the system, this "
                    "process can never run.";
     return;
@@ -48,20 +231,72 @@ Proc_affinity::Proc_affinity(Status_Manager &sm, int32_t nslots, pid_t pid)
     error_string = "Unable to allocate hwloc bitmap for this process's cpuset";
     return;
   }
+  if ((cpuset_orig_ = hwloc_bitmap_alloc()) == nullptr) {
+    error_string = "Unable to allocate hwloc bitmap for this process's cpuset";
+    return;
+  }
+  if (hwloc_get_cpubind(topology_, cpuset_orig_, HWLOC_CPUBIND_PROCESS) ==
+      -1) {
+    // Not supported everywhere, assume we could run anywhere we're allowed
+    hwloc_bitmap_copy(cpuset_orig_,
+                      hwloc_topology_get_allowed_cpuset(topology_));
+  }
+}
+
+bool Proc_affinity::load_topology(const char *xml) {
+  if (hwloc_topology_init(&topology_) == -1) {
+    die_with_err_errno("Failed to initialise topology object", -1);
+  }
+  if (xml != nullptr && hwloc_topology_set_xml(topology_, xml) == -1) {
+    return false;
+  }
+  // IS_THISSYSTEM lets us bind even when loading from XML
+  if (hwloc_topology_set_flags(
+          topology_, HWLOC_TOPOLOGY_FLAG_IS_THISSYSTEM |
+                         HWLOC_TOPOLOGY_FLAG_RESTRICT_TO_CPUBINDING |
+                         HWLOC_TOPOLOGY_FLAG_DONT_CHANGE_BINDING) == -1) {
+    return false;
+  }
+  return hwloc_topology_load(topology_) == 0;
 }
 
 Proc_affinity::~Proc_affinity() {
   hwloc_bitmap_free(cpuset_mine_);
+  hwloc_bitmap_free(cpuset_orig_);
   hwloc_topology_destroy(topology_);
 }
 
-void Proc_affinity::bind(std::vector<uint32_t> in) {
+void Proc_affinity::bind(std::vector<uint32_t> in, Membind m, Smt smt) {
 
+  // Slots are hwloc logical core or PU indices
   for (const auto i : in) {
-    if (hwloc_bitmap_set(cpuset_mine_, i) == -1) {
+    auto obj = slot_obj(i);
+    if (obj == nullptr ||
+        hwloc_bitmap_or(cpuset_mine_, cpuset_mine_, obj->cpuset) == -1) {
+      error_string = "Unable to construct process binding bitmap";
+      return;
+    }
+  }
+  if (smt == Smt::idle) {
+    // Keep only one hardware thread of each core, the siblings stay idle
+    auto tmp = hwloc_bitmap_alloc();
+    auto single = hwloc_bitmap_alloc();
+    if (tmp == nullptr || single == nullptr) {
       error_string = "Unable to construct process binding bitmap";
       return;
     }
+    hwloc_obj_t core = nullptr;
+    while ((core = hwloc_get_next_obj_covering_cpuset_by_type(
+                topology_, cpuset_mine_, HWLOC_OBJ_CORE, core)) != nullptr) {
+      hwloc_bitmap_and(single, core->cpuset, cpuset_mine_);
+      hwloc_bitmap_singlify(single);
+      hwloc_bitmap_or(tmp, tmp, single);
+    }
+    if (!hwloc_bitmap_iszero(tmp)) {
+      hwloc_bitmap_copy(cpuset_mine_, tmp);
+    }
+    hwloc_bitmap_free(single);
+    hwloc_bitmap_free(tmp);
   }
 
   if (hwloc_set_cpubind(topology_, cpuset_mine_,
@@ -71,9 +306,352 @@ void Proc_affinity::bind(std::vector<uint32_t> in) {
     return;
   }
 
-  return;
+  if (m == Membind::none) {
+    return;
+  }
+  // Memory policy is per-thread on Linux and is inherited by the job
+  // through fork and exec. Passing a cpuset lets hwloc pick the NUMA
+  // nodes covering it. Linux treats a non-strict bind as 'preferred'.
+  if (!hwloc_topology_get_support(topology_)
+           ->membind->set_thisthread_membind) {
+    error_string = "Memory binding is not supported on this system";
+    return;
+  }
+  hwloc_membind_policy_t policy = HWLOC_MEMBIND_BIND;
+  int flags = HWLOC_MEMBIND_THREAD;
+  switch (m) {
+  case Membind::bind:
+    flags |= HWLOC_MEMBIND_STRICT;
+    break;
+  case Membind::interleave:
+    policy = HWLOC_MEMBIND_INTERLEAVE;
+    break;
+  case Membind::none:
+  case Membind::preferred:
+    break;
+  }
+  if (hwloc_set_membind(topology_, cpuset_mine_, policy, flags) == -1) {
+    error_string = "Unable to bind process memory";
+    return;
+  }
+  membound_ = true;
+}
+
+std::string Proc_affinity::bound_nodes() {
+  std::string out;
+  auto nodeset = hwloc_bitmap_alloc();
+  if (nodeset == nullptr) {
+    return out;
+  }
+  hwloc_cpuset_to_nodeset(topology_, cpuset_mine_, nodeset);
+  char *tmp;
+  if (hwloc_bitmap_list_asprintf(&tmp, nodeset) != -1) {
+    out = tmp;
+    free(tmp);
+  }
+  hwloc_bitmap_free(nodeset);
+  return out;
+}
+
+std::string Proc_affinity::bound_cpus() {
+  std::string out;
+  char *tmp;
+  if (hwloc_bitmap_list_asprintf(&tmp, cpuset_mine_) != -1) {
+    out = tmp;
+    free(tmp);
+  }
+  return out;
+}
+
+std::vector<uint32_t>
+Proc_affinity::physical_ids(const std::vector<uint32_t> &slots, Smt smt) {
+  // One OS PU index per process to run, for tools such as OpenMPI
+  // rankfiles that expect physical processor ids. That is each PU when
+  // hardware threads are in use, otherwise the first PU of each core.
+  std::vector<uint32_t> out;
+  std::vector<hwloc_obj_t> seen;
+  for (const auto i : slots) {
+    auto obj = slot_obj(i);
+    if (obj == nullptr) {
+      out.push_back(i);
+      continue;
+    }
+    if (slot_type_ == HWLOC_OBJ_PU && smt == Smt::use) {
+      out.push_back(obj->os_index);
+      continue;
+    }
+    auto core = core_of(obj);
+    if (std::find(seen.begin(), seen.end(), core) != seen.end()) {
+      continue;
+    }
+    seen.push_back(core);
+    out.push_back(hwloc_bitmap_first(core->cpuset));
+  }
+  return out;
+}
+
+hwloc_obj_t Proc_affinity::slot_obj(uint32_t i) {
+  return hwloc_get_obj_by_type(topology_, slot_type_, i);
+}
+
+hwloc_obj_t Proc_affinity::core_of(hwloc_obj_t obj) {
+  if (obj->type == HWLOC_OBJ_CORE) {
+    return obj;
+  }
+  auto core = hwloc_get_ancestor_obj_by_type(topology_, HWLOC_OBJ_CORE, obj);
+  // Some platforms don't report cores, treat each PU as its own core
+  return core == nullptr ? obj : core;
 }
 
+void Proc_affinity::build_domains() {
+  auto add_domain = [&](hwloc_obj_t obj, bool is_numa) {
+    slot_domain d{hwloc_obj_type_is_cache(obj->type) == 1, is_numa, {}};
+    for (auto i = 0; i < total_slots_; ++i) {
+      if (hwloc_bitmap_isincluded(slot_obj(i)->cpuset, obj->cpuset)) {
+        d.slots.push_back(i);
+      }
+    }
+    if (!d.slots.empty()) {
+      domains_.push_back(d);
+    }
+  };
+  // Everything above the slots in the main tree (cores in PU mode,
+  // caches, groups, packages, machine), deepest first, then NUMA nodes
+  // which hang off the side
+  auto slot_depth = hwloc_get_type_depth(topology_, slot_type_);
+  for (auto depth = slot_depth - 1; depth >= 0; --depth) {
+    for (auto i = 0u; i < hwloc_get_nbobjs_by_depth(topology_, depth); ++i) {
+      add_domain(hwloc_get_obj_by_depth(topology_, depth, i), false);
+    }
+  }
+  for (auto i = 0; i < hwloc_get_nbobjs_by_type(topology_, HWLOC_OBJ_NUMANODE);
+       ++i) {
+    add_domain(hwloc_get_obj_by_type(topology_, HWLOC_OBJ_NUMANODE, i), true);
+  }
+  std::stable_sort(domains_.begin(), domains_.end(),
+                   [](const slot_domain &a, const slot_domain &b) {
+                     return a.slots.size() < b.slots.size();
+                   });
+}
+
+std::vector<uint32_t>
+Proc_affinity::choose_slots(const std::vector<uint32_t> &in_use,
+                            int32_t nslots, Distribution d, Smt smt) {
+  std::vector<bool> used(total_slots_, false);
+  for (const auto s : in_use) {
+    if (s < used.size()) {
+      used[s] = true;
+    }
+  }
+  // To reserve whole cores in PU mode, choose from the first PU of each
+  // completely free core and then add the siblings
+  auto whole_cores = slot_type_ == HWLOC_OBJ_PU && smt == Smt::idle;
+  auto siblings = [&](uint32_t s) {
+    std::vector<uint32_t> out;
+    auto core = core_of(slot_obj(s));
+    hwloc_obj_t pu = nullptr;
+    while ((pu = hwloc_get_next_obj_inside_cpuset_by_type(
+                topology_, core->cpuset, HWLOC_OBJ_PU, pu)) != nullptr) {
+      if (pu->logical_index < used.size()) {
+        out.push_back(pu->logical_index);
+      }
+    }
+    return out;
+  };
+  if (whole_cores) {
+    auto avail = std::vector<bool>(used.size(), false);
+    for (auto s = 0u; s < used.size(); ++s) {
+      auto sib = siblings(s);
+      if (sib.empty() || sib.front() != s) {
+        continue;
+      }
+      avail[s] = std::none_of(sib.begin(), sib.end(),
+                              [&](uint32_t i) { return used[i]; });
+    }
+    for (auto s = 0u; s < used.size(); ++s) {
+      used[s] = !avail[s];
+    }
+  }
+  auto n = static_cast<size_t>(nslots);
+  auto free_in = [&](const slot_domain &dom) {
+    std::vector<uint32_t> out;
+    for (const auto s : dom.slots) {
+      if (!used[s]) {
+        out.push_back(s);
+      }
+    }
+    return out;
+  };
+  // First fit among the smallest domains that can hold the job
+  auto first_fit = [&](auto filter) -> std::vector<uint32_t> {
+    for (const auto &dom : domains_) {
+      if (!filter(dom)) {
+        continue;
+      }
+      auto avail = free_in(dom);
+      if (avail.size() >= n) {
+        avail.resize(n);
+        return avail;
+      }
+    }
+    return {};
+  };
+
+  std::vector<uint32_t> out;
+  switch (d) {
+  case Distribution::linear:
+    for (auto s = 0u; s < used.size() && out.size() < n; ++s) {
+      if (!used[s]) {
+        out.push_back(s);
+      }
+    }
+    break;
+  case Distribution::compact:
+    out = first_fit([](const slot_domain &) { return true; });
+    break;
+  case Distribution::cache: {
+    // Best fit: the cache domain with the fewest free cores that still
+    // fits, so larger free domains are left for larger jobs
+    std::vector<uint32_t> best;
+    for (const auto &dom : domains_) {
+      if (!dom.is_cache) {
+        continue;
+      }
+      auto avail = free_in(dom);
+      if (avail.size() >= n && (best.empty() || avail.size() < best.size())) {
+        best = avail;
+      }
+    }
+    if (!best.empty()) {
+      best.resize(n);
+      out = best;
+      break;
+    }
+    out = first_fit([](const slot_domain &dom) { return dom.is_numa; });
+    if (out.empty()) {
+      out = first_fit([](const slot_domain &) { return true; });
+    }
+    break;
+  }
+  case Distribution::scatter: {
+    // Round-robin over the NUMA nodes (or packages if there is only one
+    // NUMA node), always taking from the one with the most free cores
+    std::vector<std::vector<uint32_t>> spread;
+    for (const auto &dom : domains_) {
+      if (dom.is_numa) {
+        spread.push_back(free_in(dom));
+      }
+    }
+    if (spread.size() < 2) {
+      spread.clear();
+      for (auto i = 0;
+           i < hwloc_get_nbobjs_by_type(topology_, HWLOC_OBJ_PACKAGE); ++i) {
+        auto pkg = hwloc_get_obj_by_type(topology_, HWLOC_OBJ_PACKAGE, i);
+        std::vector<uint32_t> avail;
+        for (auto s = 0u; s < used.size(); ++s) {
+          if (!used[s] &&
+              hwloc_bitmap_isincluded(slot_obj(s)->cpuset, pkg->cpuset)) {
+            avail.push_back(s);
+          }
+        }
+        spread.push_back(avail);
+      }
+    }
+    std::vector<size_t> taken(spread.size(), 0);
+    while (out.size() < n) {
+      auto best = spread.size();
+      for (auto i = 0ul; i < spread.size(); ++i) {
+        if (taken[i] < spread[i].size() &&
+            (best == spread.size() ||
+             spread[i].size() - taken[i] > spread[best].size() - taken[best])) {
+          best = i;
+        }
+      }
+      if (best == spread.size()) {
+        break;
+      }
+      out.push_back(spread[best][taken[best]++]);
+    }
+    if (out.size() < n) {
+      // Cores outside any NUMA node/package, shouldn't happen
+      out = first_fit([](const slot_domain &) { return true; });
+    }
+    break;
+  }
+  }
+  if (out.size() < n) {
+    return {};
+  }
+  if (whole_cores) {
+    std::vector<uint32_t> expanded;
+    for (const auto s : out) {
+      auto sib = siblings(s);
+      expanded.insert(expanded.end(), sib.begin(), sib.end());
+    }
+    out = expanded;
+  }
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+void Proc_affinity::unbind() {
+  if (hwloc_set_cpubind(topology_, cpuset_orig_, HWLOC_CPUBIND_PROCESS) ==
+      -1) {
+    error_string = "Unable to restore process binding";
+  }
+  if (membound_) {
+    if (hwloc_set_membind(topology_,
+                          hwloc_topology_get_complete_nodeset(topology_),
+                          HWLOC_MEMBIND_DEFAULT,
+                          HWLOC_MEMBIND_THREAD | HWLOC_MEMBIND_BYNODESET) ==
+        -1) {
+      error_string = "Unable to restore process memory binding";
+    }
+    membound_ = false;
+  }
+}
+
+void Proc_affinity::bind_outside(const std::vector<uint32_t> &in_use) {
+  auto cpuset = hwloc_bitmap_dup(cpuset_orig_);
+  if (cpuset == nullptr) {
+    error_string = "Unable to construct process binding bitmap";
+    return;
+  }
+  for (const auto i : in_use) {
+    if (auto obj = slot_obj(i)) {
+      hwloc_bitmap_andnot(cpuset, cpuset, obj->cpuset);
+    }
+  }
+  if (hwloc_bitmap_iszero(cpuset)) {
+    hwloc_bitmap_copy(cpuset, cpuset_orig_);
+  }
+  if (hwloc_set_cpubind(topology_, cpuset, HWLOC_CPUBIND_PROCESS) == -1) {
+    error_string = "Unable to bind process";
+  }
+  hwloc_bitmap_free(cpuset);
+}
+
+int32_t Proc_affinity::total_slots() { return total_slots_; }
+
+int64_t Proc_affinity::total_memory() {
+  auto mem = static_cast<int64_t>(hwloc_get_root_obj(topology_)->total_memory);
+  if (mem == 0) {
+    // Not every topology source reports memory
+    mem = static_cast<int64_t>(sysconf(_SC_PHYS_PAGES)) *
+          sysconf(_SC_PAGESIZE);
+  }
+  return mem;
+}
+
+int32_t Proc_affinity::capacity(Smt smt) {
+  if (slot_type_ == HWLOC_OBJ_PU && smt == Smt::idle) {
+    return hwloc_get_nbobjs_by_type(topology_, HWLOC_OBJ_CORE);
+  }
+  return total_slots_;
+}
+
+Slot_unit Proc_affinity::slot_unit() { return slot_unit_; }
+
 std::vector<pid_t> Proc_affinity::get_siblings() {
   return sm_.get_running_job_pids(pid_);
 }
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <cstdint>
+#include <filesystem>
 #include <hwloc.h>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <sys/types.h>
 #include <unistd.h>
@@ -10,19 +13,109 @@
 #include "status_manager.hpp"
 
 namespace tsp {
+
+// How multi-slot jobs are placed on the node's cores
+enum class Distribution {
+  linear,  // Lowest numbered free slots
+  compact, // Smallest topology domain with enough free cores
+  scatter, // Spread evenly across NUMA nodes/packages
+  cache,   // Best-fitting shared cache domain, then NUMA node, then compact
+};
+
+std::optional<Distribution> distribution_from_string(std::string_view in);
+std::string_view distribution_to_string(Distribution d);
+
+// Memory placement policy on the NUMA nodes covering the bound cores
+enum class Membind {
+  none,       // First touch, wherever the kernel decides
+  bind,       // Only allocate on the local NUMA nodes
+  interleave, // Round-robin pages across the local NUMA nodes
+  preferred,  // Local NUMA nodes first, spill elsewhere when they're full
+};
+
+std::optional<Membind> membind_from_string(std::string_view in);
+std::string_view membind_to_string(Membind m);
+
+// What a slot is. This is a node-wide setting, stored in the database.
+enum class Slot_unit {
+  core, // A physical core with all of its hardware threads
+  pu,   // A single hardware thread
+};
+
+std::optional<Slot_unit> slot_unit_from_string(std::string_view in);
+std::string_view slot_unit_to_string(Slot_unit u);
+constexpr std::string_view slot_unit_setting("slot_unit");
+
+// Loaded topologies are exported as XML to get_tmp(), one file per
+// combination of host, boot, cgroup and CPU binding. Only the most recently
+// written topology_cache_max_files are kept.
+constexpr std::string_view topology_cache_template{"tsp_topology_"};
+constexpr size_t topology_cache_max_files{32};
+
+// Whether a job may run on the SMT siblings of its cores
+enum class Smt {
+  use,  // Bind to every hardware thread of the allocated slots
+  idle, // Reserve whole cores, bind to one hardware thread of each
+};
+
+std::optional<Smt> smt_from_string(std::string_view in);
+std::string_view smt_to_string(Smt s);
+
 class Proc_affinity {
 public:
-  Proc_affinity(Status_Manager &sm, int32_t nslots, pid_t pid);
+  Proc_affinity(Status_Manager &sm, int32_t nslots, pid_t pid,
+                Smt smt = Smt::use);
   ~Proc_affinity();
-  void bind(std::vector<uint32_t> in);
+  void bind(std::vector<uint32_t> in, Membind m = Membind::none,
+            Smt smt = Smt::use);
+  // NUMA nodes covering the bound cores, in hwloc list format
+  std::string bound_nodes();
+  // OS indices of the bound PUs, in hwloc list format
+  std::string bound_cpus();
+  // Returns an empty vector if there aren't enough free slots
+  // With Smt::idle in PU mode, the whole cores covering nslots hardware
+  // threads are allocated
+  std::vector<uint32_t> choose_slots(const std::vector<uint32_t> &in_use,
+                                     int32_t nslots, Distribution d,
+                                     Smt smt = Smt::use);
+  std::vector<uint32_t> physical_ids(const std::vector<uint32_t> &slots,
+                                     Smt smt = Smt::use);
+  void unbind();
+  // Binds this process to the PUs it started on that none of the slots in
+  // in_use cover, for helpers that shouldn't compete with jobs. If that
+  // leaves nothing, the original binding is restored.
+  void bind_outside(const std::vector<uint32_t> &in_use);
+  int32_t total_slots();
+  // Bytes of memory on the node
+  int64_t total_memory();
+  // The largest job that could ever fit on this node
+  int32_t capacity(Smt smt);
+  Slot_unit slot_unit();
   std::string error_string;
 
 private:
+  struct slot_domain {
+    bool is_cache;
+    bool is_numa;
+    std::vector<uint32_t> slots;
+  };
   Status_Manager &sm_;
   hwloc_topology_t topology_;
   hwloc_bitmap_t cpuset_mine_;
+  hwloc_bitmap_t cpuset_orig_;
+  bool membound_;
   const int32_t nslots_;
+  Slot_unit slot_unit_;
+  hwloc_obj_type_t slot_type_;
+  int32_t total_slots_;
   const pid_t pid_;
+  // All topology objects containing cores, smallest first
+  std::vector<slot_domain> domains_;
   std::vector<pid_t> get_siblings();
+  // From the XML file xml, or the running system if that's null
+  bool load_topology(const char *xml);
+  void build_domains();
+  hwloc_obj_t slot_obj(uint32_t i);
+  hwloc_obj_t core_of(hwloc_obj_t obj);
 };
 } // namespace tsp
\ No newline at end of file
@@ -35,6 +35,9 @@ Run_cmd::Run_cmd(std::string serialised)
   proc_to_run_.pop_back();
 }
 
+Run_cmd::Run_cmd(std::vector<std::string> args)
+    : is_openmpi(check_mpi(args[0].c_str())), proc_to_run_(args) {}
+
 Run_cmd::~Run_cmd() {
   if (is_openmpi) {
     if (!rf_name_.empty()) {
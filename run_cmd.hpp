@@ -10,6 +10,7 @@ public:
   const bool is_openmpi;
   Run_cmd(char *cmdline[], int start, int end);
   Run_cmd(std::string serialised);
+  Run_cmd(std::vector<std::string> args);
   ~Run_cmd();
   std::vector<std::string> get();
   std::string print();
@@ -0,0 +1,105 @@
+#include "slot_watcher.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "functions.hpp"
+
+namespace tsp {
+
+void notify_slot_watchers() {
+  // Closing a file opened for writing generates IN_CLOSE_WRITE for
+  // anyone watching the sentinel. No data needs to be written.
+  auto fd = open((get_tmp() / slot_sentinel_name).c_str(),
+                 O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+Slot_watcher::Slot_watcher()
+    : sentinel_fn_(get_tmp() / slot_sentinel_name), inotify_fd_(-1),
+      watch_fd_(-1) {
+#ifdef __linux__
+  // If inotify is unavailable, wait() degrades to a plain sleep
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  add_watch();
+#endif
+}
+
+Slot_watcher::~Slot_watcher() {
+  if (inotify_fd_ != -1) {
+    close(inotify_fd_);
+  }
+}
+
+void Slot_watcher::add_watch() {
+#ifdef __linux__
+  if (inotify_fd_ == -1) {
+    return;
+  }
+  // The sentinel must exist before it can be watched
+  auto fd = open(sentinel_fn_.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return;
+  }
+  close(fd);
+  watch_fd_ = inotify_add_watch(inotify_fd_, sentinel_fn_.c_str(),
+                                IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF);
+#endif
+}
+
+int Slot_watcher::get_fd() {
+  if (watch_fd_ == -1) {
+    add_watch();
+  }
+  return watch_fd_ == -1 ? -1 : inotify_fd_;
+}
+
+void Slot_watcher::drain() {
+#ifdef __linux__
+  // Consume all pending events so that the next poll blocks
+  alignas(struct inotify_event) char buf[4096];
+  ssize_t len;
+  while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+    for (auto ptr = buf; ptr < buf + len;) {
+      auto event = reinterpret_cast<const struct inotify_event *>(ptr);
+      if (event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+        watch_fd_ = -1;
+      }
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+#endif
+}
+
+bool Slot_watcher::wait(std::chrono::milliseconds timeout) {
+#ifdef __linux__
+  if (watch_fd_ == -1) {
+    // Sentinel may have been removed from under us, try again
+    add_watch();
+  }
+  if (watch_fd_ != -1) {
+    struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+    auto ret = poll(&pfd, 1, timeout.count());
+    if (ret <= 0) {
+      return false;
+    }
+    drain();
+    return true;
+  }
+#endif
+  std::this_thread::sleep_for(timeout);
+  return false;
+}
+} // namespace tsp
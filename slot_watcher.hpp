@@ -0,0 +1,30 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <string_view>
+
+namespace tsp {
+
+constexpr std::string_view slot_sentinel_name{"tsp_slots_freed"};
+
+void notify_slot_watchers();
+
+class Slot_watcher {
+public:
+  Slot_watcher();
+  ~Slot_watcher();
+  // Block until another tsp instance signals that slots have been
+  // freed, or until timeout has elapsed. Returns true if woken early
+  bool wait(std::chrono::milliseconds timeout);
+  // For callers running their own poll() loop
+  int get_fd();
+  void drain();
+
+private:
+  const std::filesystem::path sentinel_fn_;
+  int inotify_fd_;
+  int watch_fd_;
+  void add_watch();
+};
+} // namespace tsp
@@ -1,22 +1,35 @@
 #include "spooler.hpp"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
+#include <filesystem>
 #include <format>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
 
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "backfill.hpp"
+#include "cgroup.hpp"
+#include "daemon_client.hpp"
 #include "functions.hpp"
 #include "help.hpp"
 #include "jitter.hpp"
 #include "output_manager.hpp"
 #include "proc_affinity.hpp"
+#include "slot_watcher.hpp"
 #include "status_manager.hpp"
 
 bool time_to_die = false;
@@ -44,7 +57,19 @@ auto signals_to_forward = {SIGINT, SIGHUP, SIGTERM};
 
 namespace tsp {
 
-constexpr std::chrono::milliseconds base_wait_period{2000};
+// Waiting jobs are woken when slots are freed, this is only a safety net
+// in case a notification is missed (e.g. a tsp instance was SIGKILLed)
+constexpr std::chrono::milliseconds fallback_wait_period{10000};
+// Waiters at least this many full nodes back in the queue share the
+// longest wakeup backoff
+constexpr int64_t max_backoff_waves{4};
+// How often to check for signals while waiting on the daemon
+constexpr std::chrono::milliseconds daemon_wait_period{1000};
+
+// Queue runners started by this process, it waits for them before exiting
+std::vector<pid_t> queue_runners;
+// Dependent job runners started by this process. Nothing waits on these.
+std::vector<pid_t> dependent_runners;
 
 Spooler_config::Spooler_config() {
   bool_vars = {{"disappear_output", false},
@@ -56,85 +81,244 @@ Spooler_config::Spooler_config() {
 #else
                {"binding", true}};
 #endif
-  int_vars = {{"nslots", 1}, {"rerun", -1}};
+  int_vars = {
+      {"nslots", 1}, {"rerun", -1}, {"est_time", -1}, {"priority", 0}};
 }
 
-int do_spooler(Spooler_config config, int argc, int optind, char *argv[]) {
-
-  auto rerun = (config.get_int("rerun") >= 0);
+// Store any node-wide settings given on the command line. Slot numbers
+// mean different things in each slot unit, so that can only be changed
+// while no jobs are running or queued.
+void apply_node_settings(Spooler_config &config, Status_Manager &stat) {
+  if (!config.get_string("fair_share").empty()) {
+    stat.set_node_setting("fair_share", config.get_string("fair_share"));
+  }
+  if (!config.get_string("mem_budget").empty()) {
+    stat.set_node_setting(
+        "mem_budget",
+        std::to_string(parse_size(config.get_string("mem_budget")).value()));
+  }
+  auto requested = config.get_string("slot_unit");
+  if (requested.empty()) {
+    return;
+  }
+  auto current = slot_unit_from_string(
+                     stat.get_node_setting(std::string{slot_unit_setting}))
+                     .value_or(Slot_unit::core);
+  if (slot_unit_from_string(requested) == current) {
+    return;
+  }
+  if (!stat.set_node_setting_when_idle(std::string{slot_unit_setting},
+                                       requested)) {
+    die_with_err(std::format("ERROR! Cannot change slot unit from {} to {} "
+                             "while jobs are running or queued",
+                             slot_unit_to_string(current), requested),
+                 -1);
+  }
+}
 
-  if (!rerun) {
-    if (optind == argc) {
-      std::cerr << std::format(tsp::help, argv[0]) << std::endl;
-      die_with_err(
-          "ERROR! Requested to run a command, but no command specified", -1);
-    }
+// Store the per-job scheduling requests from the command line
+void record_job_requests(Spooler_config &config, Status_Manager &stat,
+                         const std::vector<uint32_t> &ids) {
+  if (config.get_int("est_time") >= 0) {
+    stat.set_est_time(ids, config.get_int("est_time") * 1000000ll);
   }
+  if (config.get_int("priority") != 0) {
+    stat.set_priority(ids, config.get_int("priority"));
+  }
+  if (auto mem = config.get_string("mem"); mem == "auto") {
+    stat.set_mem_from_history(ids);
+  } else if (!mem.empty()) {
+    stat.set_mem(ids, parse_size(mem).value());
+  }
+  // Other jobs check whether we could be placed before waiting behind us
+  if (!config.get_string("distribution").empty() ||
+      !config.get_string("smt").empty()) {
+    stat.set_placement(ids, config.get_string("distribution"),
+                       config.get_string("smt"));
+  }
+}
 
-  if (config.get_bool("do_fork")) {
-    auto main_fork_pid = pid_t{fork()};
-    if (main_fork_pid == -1) {
-      die_with_err("Unable to fork when forking requested", main_fork_pid);
-    }
-    if (main_fork_pid != 0) {
-      // We're done here
-      return 0;
-    }
+// SIZE[:HEAD:TAIL], returns the bytes to keep from the start and end of
+// the output. Without HEAD and TAIL, SIZE is split evenly.
+std::optional<std::pair<int64_t, int64_t>>
+parse_max_output(const std::string &in) {
+  std::string_view sv{in};
+  auto first = sv.find(':');
+  auto size = parse_size(sv.substr(0, first));
+  if (!size) {
+    return std::nullopt;
+  }
+  if (first == std::string_view::npos) {
+    return std::pair{size.value() / 2, size.value() - size.value() / 2};
+  }
+  auto second = sv.find(':', first + 1);
+  if (second == std::string_view::npos) {
+    return std::nullopt;
   }
+  auto head = parse_size(sv.substr(first + 1, second - first - 1));
+  auto tail = parse_size(sv.substr(second + 1));
+  if (!head || !tail || head.value() + tail.value() > size.value()) {
+    return std::nullopt;
+  }
+  return std::pair{head.value(), tail.value()};
+}
 
-  auto stat = tsp::Status_Manager{};
-  auto cmd = rerun
-                 ? tsp::Run_cmd{stat.get_cmd_to_rerun(config.get_int("rerun"))}
-                 : tsp::Run_cmd{argv, optind, argc};
-  if (rerun) {
-    // This variant of add_cmd will recover category and nslots from the jobid
-    stat.add_cmd(cmd, config.get_int("rerun"));
-  } else {
-    stat.add_cmd(cmd, config.get_string("category"), config.get_int("nslots"));
+// Start any jobs that were waiting on a job that has just ended, or on a
+// job that was cancelled along with it. The slots it frees may also be
+// enough for queued work whose runners have died.
+void start_waiting_work(Status_Manager &stat) {
+  std::ranges::copy(start_eligible_jobs(stat.get_eligible_dependents()),
+                    std::back_inserter(dependent_runners));
+  if (auto runner_pid = start_queue_runner(stat)) {
+    queue_runners.push_back(runner_pid.value());
   }
+}
+
+void end_job(Status_Manager &stat, int exit_stat) {
+  stat.job_end(exit_stat);
+  start_waiting_work(stat);
+}
+
+void end_job(
+    Status_Manager &stat, int exit_stat,
+    const std::pair<std::filesystem::path, std::filesystem::path> &output) {
+  stat.job_end(exit_stat, output);
+  start_waiting_work(stat);
+}
+
+// Wait for a slot allocation, then run cmd to completion in the working
+// directory and environment described by ps. Returns the job's exit status.
+// Claimed jobs were queued ahead of time, so their state is already stored
+// and they aren't part of a burst of submissions that needs staggering.
+int run_job(Spooler_config &config, Status_Manager &stat, Run_cmd &cmd,
+            uint32_t extern_jobid, prog_state &ps, bool claimed) {
+
   for (const auto sig : signals_to_forward) {
     signal(sig, sigintHandlerPreFork);
   }
-  auto extern_jobid = stat.get_extern_jobid();
-  std::cout << extern_jobid << std::endl;
-
+  auto nslots = stat.get_slots_required();
+  auto distribution =
+      distribution_from_string(config.get_string("distribution")).value();
+  auto membind = membind_from_string(config.get_string("membind")).value();
+  auto smt = smt_from_string(config.get_string("smt")).value();
   auto jitter = tsp::Jitter{tsp::jitter_ms};
-  std::this_thread::sleep_for(tsp::jitter_ms + jitter.get());
 
-  auto binder = tsp::Proc_affinity{stat, config.get_int("nslots"), getpid()};
+  auto binder = tsp::Proc_affinity{stat, nslots, getpid(), smt};
   if (!binder.error_string.empty()) {
-    stat.job_end(-1);
+    end_job(stat, -1);
     die_with_err(binder.error_string, -1);
   }
+  if (auto mem = stat.get_mem(extern_jobid)) {
+    if (auto budget = stat.get_mem_budget().value(); mem.value() > budget) {
+      end_job(stat, -1);
+      die_with_err(std::format("ERROR! Job requires {} bytes of memory but "
+                               "the node's budget is {} bytes",
+                               mem.value(), budget),
+                   -1);
+    }
+  }
   std::vector<uint32_t> bound_cores;
+  // Start watching before the first allocation attempt so that no
+  // notification can be lost between a failed attempt and the wait
+  auto watcher = tsp::Slot_watcher{};
 
-  for (;;) {
+  // If a node scheduler daemon is running, let it hand out slots. Keep
+  // the connection open until we're done, that's how it knows we've
+  // finished.
+  auto daemon = tsp::Daemon_client{};
+  if (daemon.request_allocation(stat.jobid, nslots, distribution, smt)) {
+    if (config.get_bool("verbose")) {
+      std::cout << "Job id " << extern_jobid << ": " << cmd.print()
+                << "requesting core binding allocation from daemon\n";
+    }
+    while (daemon.connected() && bound_cores.empty()) {
+      if (time_to_die) {
+        end_job(stat, 128 + seen_signal);
+        std::exit(EXIT_FAILURE);
+      }
+      bound_cores = daemon.wait_for_allocation(daemon_wait_period);
+    }
+  }
+
+  // Slots wanted by jobs ahead of us as of the last allocation attempt
+  int64_t slots_ahead = 0;
+  if (bound_cores.empty() && !claimed) {
+    // Serverless path, stagger concurrent submissions
+    std::this_thread::sleep_for(tsp::jitter_ms + jitter.get());
+  }
+  while (bound_cores.empty()) {
     if (time_to_die) {
-      stat.job_end(128 + seen_signal);
+      end_job(stat, 128 + seen_signal);
       std::exit(EXIT_FAILURE);
     }
-    stat.insert_proc_allocation();
     if (config.get_bool("verbose")) {
       std::cout << "Job id " << extern_jobid << ": " << cmd.print()
                 << "requesting core binding allocation\n";
     }
-    bound_cores = stat.recover_proc_allocation();
-    if (!bound_cores.empty()) {
-      break;
+    auto waiting = stat.get_waiting_jobs();
+    slots_ahead = 0;
+    for (const auto &w : waiting) {
+      if (w.uuid == stat.jobid) {
+        break;
+      }
+      slots_ahead += w.slots;
+    }
+    auto in_use = stat.get_slots_in_use();
+    auto placeable = [&](const waiting_job &w) {
+      return !binder
+                  .choose_slots(
+                      in_use, w.slots,
+                      distribution_from_string(w.distribution)
+                          .value_or(Distribution::compact),
+                      smt_from_string(w.smt).value_or(Smt::use))
+                  .empty();
+    };
+    if (backfill_allows(
+            stat.jobid, waiting, stat.get_running_allocations(),
+            binder.total_slots(),
+            stat.get_mem_budget().value_or(std::numeric_limits<int64_t>::max()),
+            now(), placeable)) {
+      auto candidate = binder.choose_slots(in_use, nslots, distribution, smt);
+      if (!candidate.empty() && stat.insert_proc_allocation(candidate)) {
+        bound_cores = candidate;
+        if (waiting.size() > 1) {
+          // Jobs held back by a reservation may be able to go now
+          notify_slot_watchers();
+        }
+        break;
+      }
     }
     if (config.get_bool("verbose")) {
       std::cout << "Job id " << extern_jobid << ": " << cmd.print()
                 << "Insufficient available cores - waiting\n";
     }
-    std::this_thread::sleep_for(base_wait_period + jitter.get());
+    auto waves_ahead =
+        (slots_ahead + nslots - 1) / std::max(binder.total_slots(), 1);
+    if (watcher.wait(fallback_wait_period + jitter.get()) && waves_ahead > 0) {
+      // Every job end wakes every waiter. Those that could not start even
+      // if the whole node were free back off for a random time that grows
+      // with the queue ahead of them, rather than all hit the database at
+      // once
+      std::this_thread::sleep_for(
+          (tsp::jitter_ms + jitter.get()) *
+          std::min<int64_t>(waves_ahead, max_backoff_waves));
+    }
   }
   stat.job_start();
+  // Leave someone waiting for the next slots to free up
+  if (auto runner_pid = start_queue_runner(stat)) {
+    queue_runners.push_back(runner_pid.value());
+  }
   if (config.get_bool("binding")) {
-    binder.bind(bound_cores);
+    binder.bind(bound_cores, membind, smt);
     if (!binder.error_string.empty()) {
-      stat.job_end(-1);
+      end_job(stat, -1);
       die_with_err_errno(binder.error_string, -1);
     }
+    if (membind != Membind::none) {
+      stat.set_membind(std::string{membind_to_string(membind)},
+                       binder.bound_nodes());
+    }
   }
 
   if (config.get_bool("verbose")) {
@@ -148,35 +332,62 @@ int do_spooler(Spooler_config config, int argc, int optind, char *argv[]) {
     std::cout << std::endl;
   }
 
-  if (cmd.is_openmpi && config.get_bool("binding")) {
-    cmd.add_rankfile(bound_cores, config.get_int("nslots"));
+  auto saved_environ = environ;
+  std::filesystem::current_path(ps.wd);
+  environ = ps.env.first;
+  if (!claimed) {
+    stat.store_state(ps);
   }
 
-  prog_state ps;
-  if (rerun) {
-    ps = stat.get_state(config.get_int("rerun"));
-    std::filesystem::current_path(ps.wd);
-    environ = ps.env.first;
+  if (cmd.is_openmpi && config.get_bool("binding")) {
+    cmd.add_rankfile(binder.physical_ids(bound_cores, smt), nslots);
   }
-  stat.store_state({std::filesystem::current_path(), {environ, {}}});
 
   int child_stat;
   int ret;
   pid_t waited_on_pid;
-  auto handler =
-      tsp::Output_handler(config.get_bool("disappear_output"),
-                          config.get_bool("separate_stderr"), stat.jobid, true);
+  auto handler = tsp::Output_handler(
+      config.get_bool("disappear_output"), config.get_bool("separate_stderr"),
+      stat.jobid, true,
+      config.get_string("max_output").empty()
+          ? std::nullopt
+          : parse_max_output(config.get_string("max_output")));
   // Might have been signalled between start and here
   if (time_to_die) {
-    stat.job_end(128 + seen_signal);
+    end_job(stat, 128 + seen_signal);
     std::exit(EXIT_FAILURE);
   }
+  // Confine the job to its allocation in a cgroup of its own, if we can.
+  // Memory is only limited for explicit --mem sizes, not estimates.
+  auto cgroup = tsp::Job_cgroup{stat.jobid};
+  if (cgroup.active()) {
+    auto confined = true;
+    if (config.get_bool("binding")) {
+      confined = cgroup.set_cpus(binder.bound_cpus()) &&
+                 (membind != Membind::bind ||
+                  cgroup.set_mems(binder.bound_nodes()));
+    }
+    if (auto mem = config.get_string("mem");
+        confined && !mem.empty() && mem != "auto") {
+      confined = cgroup.set_memory_max(parse_size(mem).value());
+    }
+    if (confined) {
+      stat.set_cgroup(cgroup.path().string());
+    } else {
+      std::cerr << std::format("Unable to configure cgroup {}: {}, job will "
+                               "only be bound with hwloc",
+                               cgroup.path().string(), strerror(errno))
+                << std::endl;
+      cgroup.disable();
+    }
+  }
   // Create our own process group here for signal handling purposes
   if (setpgid(0, 0) == -1) {
-    stat.job_end(-1);
+    end_job(stat, -1);
     die_with_err_errno("Unable to set process group id", -1);
   }
   if (0 == (waited_on_pid = fork())) {
+    cgroup.enter();
     if (cmd.is_openmpi) {
       setenv("OMPI_MCA_rmaps_base_mapping_policy", "", 1);
       setenv("OMPI_MCA_rmaps_rank_file_physical", "true", 1);
@@ -190,21 +401,29 @@ int do_spooler(Spooler_config config, int argc, int optind, char *argv[]) {
     }
   }
   if (waited_on_pid == -1) {
-    stat.job_end(-1);
+    end_job(stat, -1);
     die_with_err("Error: could not fork subprocess to exec", waited_on_pid);
   }
   for (const auto sig : signals_to_forward) {
     signal(sig, sigintHandlerPostFork);
   }
+  handler.start_capture();
+  // Only wait on the job itself, any other children are runners started
+  // for dependents of earlier jobs. With --max-output the job's output
+  // comes through us, so read it while we wait. Anything written after
+  // the job exits, by processes that outlive it, is drained without
+  // blocking by finish_capture.
   for (;;) {
-    pid_t ret_pid = waitpid(-1, &child_stat, 0);
-    if (ret_pid < 0) {
-      if (errno == ECHILD) {
-        break;
-      }
+    if (handler.capturing()) {
+      handler.capture(std::chrono::milliseconds{500});
+    }
+    pid_t ret_pid = waitpid(waited_on_pid, &child_stat,
+                            handler.capturing() ? WNOHANG : 0);
+    if (ret_pid == waited_on_pid || (ret_pid < 0 && errno != EINTR)) {
+      break;
     }
   }
-  stat.save_output(handler.get_output());
+  handler.finish_capture();
   int child_exit_stat = -1;
   if (WIFEXITED(child_stat)) {
     child_exit_stat = WEXITSTATUS(child_stat);
@@ -213,7 +432,8 @@ int do_spooler(Spooler_config config, int argc, int optind, char *argv[]) {
     child_exit_stat = 128 + WTERMSIG(child_stat);
   }
 
-  stat.job_end(child_exit_stat);
+  end_job(stat, child_exit_stat, handler.output_files());
+  handler.remove_output_files();
 
   if (config.get_bool("verbose")) {
     std::cout << "Job id " << extern_jobid << ": " << cmd.print()
@@ -221,6 +441,479 @@ int do_spooler(Spooler_config config, int argc, int optind, char *argv[]) {
               << " with status " << WEXITSTATUS(child_stat) << std::endl;
   }
 
+  // ps may not outlive this call
+  environ = saved_environ;
+  if (config.get_bool("binding")) {
+    // Don't let this binding leak into the next job run by this process
+    binder.unbind();
+  }
+
   return WEXITSTATUS(child_stat);
 }
+
+// Members share the array's environment rather than each storing a copy,
+// so add the index to it when one is started. idx_var must outlive the
+// result.
+std::vector<char *> array_member_environ(char **env, std::string &idx_var) {
+  std::vector<char *> out;
+  for (auto e = env; *e != nullptr; ++e) {
+    if (!std::string_view{*e}.starts_with("TSP_ARRAY_INDEX=")) {
+      out.push_back(*e);
+    }
+  }
+  out.push_back(idx_var.data());
+  out.push_back(nullptr);
+  return out;
+}
+
+// Run a job that has been claimed by this process. Queued jobs carry the
+// options they were submitted with, any queued before they did are run
+// with the options of the runner.
+int run_claimed_job(Spooler_config &config, Status_Manager &claimer,
+                    uint32_t id) {
+  auto stat = tsp::Status_Manager{claimer.get_job_uuid(id)};
+  auto cmd = tsp::Run_cmd{stat.get_cmd_to_rerun(id)};
+  auto ps = stat.get_state(id);
+  // An array member whose runner died before starting it
+  std::string idx_var;
+  std::vector<char *> member_env;
+  if (auto member = claimer.get_array_member(id)) {
+    idx_var = std::format("TSP_ARRAY_INDEX={}", std::get<1>(member.value()));
+    member_env = array_member_environ(ps.env.first, idx_var);
+    ps.env.first = member_env.data();
+  }
+  if (auto job_config = claimer.get_job_config(id); !job_config.empty()) {
+    auto own_config = Spooler_config{};
+    own_config.deserialise(job_config);
+    return run_job(own_config, stat, cmd, id, ps, true);
+  }
+  return run_job(config, stat, cmd, id, ps, true);
+}
+
+// Fork n background tsp instances, each running runner
+std::vector<pid_t> fork_runners(int32_t n,
+                                const std::function<int()> &runner) {
+  std::vector<pid_t> out;
+  for (auto i = 0; i < n; ++i) {
+    auto runner_pid = Status_Manager::fork_without_db();
+    if (runner_pid == -1) {
+      die_with_err("Unable to fork job runner", runner_pid);
+    }
+    if (runner_pid == 0) {
+      std::exit(runner());
+    }
+    out.push_back(runner_pid);
+  }
+  return out;
+}
+
+int wait_for_runners(const std::vector<pid_t> &runners) {
+  auto ret = EXIT_SUCCESS;
+  for (const auto runner_pid : runners) {
+    int runner_stat;
+    if (waitpid(runner_pid, &runner_stat, 0) == -1 ||
+        !WIFEXITED(runner_stat) || WEXITSTATUS(runner_stat) != 0) {
+      ret = EXIT_FAILURE;
+    }
+  }
+  return ret;
+}
+
+// Jobs finishing in a long-lived runner start dependent job runners as
+// its children. Nothing waits on those, so clear them up between jobs.
+void reap_dependent_runners() {
+  std::erase_if(dependent_runners, [](pid_t runner_pid) {
+    return waitpid(runner_pid, nullptr, WNOHANG) != 0;
+  });
+}
+
+// Only start as many runners as could start a job right now. Each one
+// takes another job whenever it finishes one.
+int32_t count_runners(Proc_affinity &binder, Status_Manager &stat,
+                      int32_t nslots, int64_t njobs) {
+  auto free_slots = binder.total_slots() -
+                    static_cast<int32_t>(stat.get_slots_in_use().size());
+  return static_cast<int32_t>(
+      std::clamp<int64_t>(free_slots / nslots, 1, njobs));
+}
+
+// Start a tsp instance in the background for each of ids. Another
+// instance may get to a job first, in which case ours quietly exits.
+std::vector<pid_t> start_eligible_jobs(const std::vector<uint32_t> &ids) {
+  std::vector<pid_t> out;
+  for (const auto id : ids) {
+    auto runner_pid = Status_Manager::fork_without_db();
+    if (runner_pid == -1) {
+      die_with_err("Unable to fork dependent job runner", runner_pid);
+    }
+    if (runner_pid == 0) {
+      // Don't take signals meant for the job that started us, or hold
+      // on to its files and sockets (or the daemon's)
+      setpgid(0, 0);
+      close_inherited_fds();
+      auto claimer = tsp::Status_Manager{};
+      if (!claimer.claim_queued_job(id)) {
+        std::exit(EXIT_SUCCESS);
+      }
+      auto config = Spooler_config{};
+      std::exit(run_claimed_job(config, claimer, id));
+    }
+    out.push_back(runner_pid);
+  }
+  return out;
+}
+
+// Start the next member of an array. Returns its exit status, or nothing
+// if the array has no members left.
+std::optional<int> run_array_member(Status_Manager &claimer,
+                                    uint32_t array_id) {
+  auto idx = claimer.claim_array_index(array_id);
+  if (!idx) {
+    return std::nullopt;
+  }
+  auto [cmd_raw, ps, config_str] = claimer.get_array_to_run(array_id);
+  auto config = Spooler_config{};
+  config.deserialise(config_str);
+  auto idx_str = std::to_string(idx.value());
+  auto args = Run_cmd{cmd_raw}.get();
+  for (auto &arg : args) {
+    for (auto pos = arg.find("{}"); pos != std::string::npos;
+         pos = arg.find("{}", pos + idx_str.size())) {
+      arg.replace(pos, 2, idx_str);
+    }
+  }
+  auto idx_var = std::format("TSP_ARRAY_INDEX={}", idx_str);
+  auto env = array_member_environ(ps.env.first, idx_var);
+  prog_state member_ps{ps.wd, {env.data(), {}}};
+
+  auto stat = tsp::Status_Manager{};
+  auto cmd = tsp::Run_cmd{args};
+  stat.add_cmd(cmd, config.get_string("category"), config.get_int("nslots"));
+  stat.add_array_member(array_id, idx.value(), config_str);
+  record_job_requests(config, stat, {stat.get_extern_jobid()});
+  return run_job(config, stat, cmd, stat.get_extern_jobid(), member_ps, true);
+}
+
+// Run queued jobs and array members until there are none left. Each job
+// that starts leaves another runner waiting if there is more to do, so
+// runners are added as slots free up rather than all at submission.
+int run_queued_work(Spooler_config &config) {
+  auto claimer = tsp::Status_Manager{};
+  auto failed = false;
+  for (;;) {
+    if (auto id = claimer.claim_queued_job()) {
+      if (run_claimed_job(config, claimer, id.value()) != 0) {
+        failed = true;
+      }
+    } else if (auto array_id = claimer.get_pending_array()) {
+      // Another runner may take the last member first
+      if (run_array_member(claimer, array_id.value()).value_or(0) != 0) {
+        failed = true;
+      }
+    } else {
+      break;
+    }
+    reap_dependent_runners();
+  }
+  if (wait_for_runners(queue_runners) != 0) {
+    failed = true;
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+std::optional<pid_t> start_queue_runner(Status_Manager &stat) {
+  if (stat.release_orphaned_jobs() ||
+      (stat.count_unclaimed_jobs() == 0 && !stat.get_pending_array())) {
+    return std::nullopt;
+  }
+  auto runner_pid = Status_Manager::fork_without_db();
+  if (runner_pid == -1) {
+    die_with_err("Unable to fork job runner", runner_pid);
+  }
+  if (runner_pid == 0) {
+    // As for dependent job runners
+    setpgid(0, 0);
+    close_inherited_fds();
+    queue_runners.clear();
+    dependent_runners.clear();
+    auto config = Spooler_config{};
+    std::exit(run_queued_work(config));
+  }
+  return runner_pid;
+}
+
+std::vector<uint32_t> parse_id_list(const std::string &in) {
+  std::vector<uint32_t> out;
+  std::stringstream ss{in};
+  std::string tok;
+  while (std::getline(ss, tok, ',')) {
+    if (tok.empty() || !std::all_of(tok.begin(), tok.end(), ::isdigit)) {
+      die_with_err(std::format("ERROR! Invalid job id list: {}", in), -1);
+    }
+    out.push_back(std::stoul(tok));
+  }
+  return out;
+}
+
+// Queue a job that can't start until other jobs have finished. No tsp
+// instance waits for it, one is started by whichever job finishes last.
+int do_dependent(Spooler_config &config, int argc, int optind,
+                 char *argv[]) {
+  auto after = parse_id_list(config.get_string("after"));
+  auto afterok = parse_id_list(config.get_string("afterok"));
+  auto stat = tsp::Status_Manager{};
+  apply_node_settings(config, stat);
+  auto cmd = tsp::Run_cmd{argv, optind, argc};
+  prog_state ps{std::filesystem::current_path(), {environ, {}}};
+  auto id = stat.add_dependent_cmd(cmd, config.get_string("category"),
+                                   config.get_int("nslots"), ps, after,
+                                   afterok, config.serialise());
+  record_job_requests(config, stat, {id});
+  // A parent may have finished before we were recorded
+  stat.cancel_failed_dependents();
+  std::cout << id << std::endl;
+
+  auto runners = start_eligible_jobs(
+      stat.job_is_eligible(id) ? std::vector<uint32_t>{id}
+                               : std::vector<uint32_t>{});
+  if (config.get_bool("do_fork")) {
+    return EXIT_SUCCESS;
+  }
+  return wait_for_runners(runners);
+}
+
+std::vector<Run_cmd> read_batch_file(const std::string &fn) {
+  std::ifstream batch_file;
+  if (fn != "-") {
+    batch_file.open(fn);
+    if (!batch_file.is_open()) {
+      die_with_err(std::format("Unable to open batch file {}", fn), -1);
+    }
+  }
+  std::istream &in = (fn == "-") ? std::cin : batch_file;
+  std::vector<Run_cmd> out;
+  std::string line;
+  while (std::getline(in, line)) {
+    auto args = split_cmdline(line);
+    if (args.empty() || args[0].starts_with('#')) {
+      continue;
+    }
+    out.emplace_back(args);
+  }
+  return out;
+}
+
+int do_batch(Spooler_config &config) {
+  auto cmds = read_batch_file(config.get_string("batch"));
+  if (cmds.empty()) {
+    die_with_err("ERROR! Batch submission requested, but no commands found",
+                 -1);
+  }
+
+  auto stat = tsp::Status_Manager{};
+  apply_node_settings(config, stat);
+  auto smt = smt_from_string(config.get_string("smt")).value();
+  auto binder =
+      tsp::Proc_affinity{stat, config.get_int("nslots"), getpid(), smt};
+  if (!binder.error_string.empty()) {
+    die_with_err(binder.error_string, -1);
+  }
+  prog_state ps{std::filesystem::current_path(), {environ, {}}};
+  auto ids = stat.add_cmds(cmds, config.get_string("category"),
+                           config.get_int("nslots"), ps, config.serialise());
+  record_job_requests(config, stat, ids);
+  for (const auto id : ids) {
+    std::cout << id << "\n";
+  }
+  std::cout << std::flush;
+
+  // More runners are started as these start jobs and as slots free up,
+  // and any of them will pick up jobs left behind by dead runners
+  auto runners = fork_runners(
+      count_runners(binder, stat, config.get_int("nslots"),
+                    std::max<int64_t>(stat.count_unclaimed_jobs(), 1)),
+      [&]() { return run_queued_work(config); });
+
+  if (config.get_bool("do_fork")) {
+    return EXIT_SUCCESS;
+  }
+  return wait_for_runners(runners);
+}
+
+std::tuple<int64_t, int64_t, int64_t>
+parse_array_range(const std::string &in) {
+  // FIRST-LAST[:STEP]
+  int64_t first;
+  int64_t last;
+  int64_t step = 1;
+  char dash;
+  char colon;
+  std::stringstream ss{in};
+  ss >> first >> dash >> last;
+  auto ok = !ss.fail() && dash == '-';
+  if (ok && ss >> colon) {
+    ss >> step;
+    ok = !ss.fail() && colon == ':';
+  }
+  if (!ok || !ss.eof() || first < 0 || last < first || step < 1) {
+    die_with_err(std::format("ERROR! Invalid array range: {}", in), -1);
+  }
+  return {first, last, step};
+}
+
+int do_array(Spooler_config &config, int argc, int optind, char *argv[]) {
+  auto [first, last, step] = parse_array_range(config.get_string("array"));
+  auto stat = tsp::Status_Manager{};
+  apply_node_settings(config, stat);
+  auto smt = smt_from_string(config.get_string("smt")).value();
+  auto binder =
+      tsp::Proc_affinity{stat, config.get_int("nslots"), getpid(), smt};
+  if (!binder.error_string.empty()) {
+    die_with_err(binder.error_string, -1);
+  }
+  auto cmd = tsp::Run_cmd{argv, optind, argc};
+  prog_state ps{std::filesystem::current_path(), {environ, {}}};
+  auto array_id = stat.add_array(cmd, config.get_string("category"),
+                                 config.get_int("nslots"), ps, first, last,
+                                 step, config.serialise());
+  std::cout << "A" << array_id << std::endl;
+
+  auto runners = fork_runners(
+      count_runners(binder, stat, config.get_int("nslots"),
+                    (last - first) / step + 1),
+      [&]() { return run_queued_work(config); });
+
+  if (config.get_bool("do_fork")) {
+    return EXIT_SUCCESS;
+  }
+  return wait_for_runners(runners);
+}
+
+int do_spooler(Spooler_config config, int argc, int optind, char *argv[]) {
+
+  auto rerun = (config.get_int("rerun") >= 0);
+
+  if (!distribution_from_string(config.get_string("distribution"))) {
+    die_with_err(std::format("ERROR! Unknown distribution: {}",
+                             config.get_string("distribution")),
+                 -1);
+  }
+  if (!membind_from_string(config.get_string("membind"))) {
+    die_with_err(std::format("ERROR! Unknown memory binding policy: {}",
+                             config.get_string("membind")),
+                 -1);
+  }
+  if (!slot_unit_from_string(config.get_string("slot_unit"))) {
+    die_with_err(std::format("ERROR! Unknown slot unit: {}",
+                             config.get_string("slot_unit")),
+                 -1);
+  }
+  if (!smt_from_string(config.get_string("smt"))) {
+    die_with_err(
+        std::format("ERROR! Unknown SMT policy: {}", config.get_string("smt")),
+        -1);
+  }
+  if (auto fs = config.get_string("fair_share");
+      !fs.empty() && fs != "on" && fs != "off") {
+    die_with_err(std::format("ERROR! --fair-share must be on or off, not {}",
+                             fs),
+                 -1);
+  }
+  if (auto mem = config.get_string("mem");
+      !mem.empty() && mem != "auto" && !parse_size(mem)) {
+    die_with_err(std::format("ERROR! Invalid memory size: {}", mem), -1);
+  }
+  if (auto budget = config.get_string("mem_budget");
+      !budget.empty() && !parse_size(budget)) {
+    die_with_err(std::format("ERROR! Invalid memory budget: {}", budget), -1);
+  }
+  if (auto max_output = config.get_string("max_output");
+      !max_output.empty() && !parse_max_output(max_output)) {
+    die_with_err(std::format("ERROR! Invalid output limit: {}", max_output),
+                 -1);
+  }
+  if (!config.get_bool("binding") &&
+      membind_from_string(config.get_string("membind")) != Membind::none) {
+    die_with_err("ERROR! Memory binding requires core binding", -1);
+  }
+
+  if (!config.get_string("array").empty()) {
+    if (rerun || !config.get_string("batch").empty() ||
+        !config.get_string("after").empty() ||
+        !config.get_string("afterok").empty()) {
+      die_with_err("ERROR! --array cannot be combined with --rerun, --batch, "
+                   "--after or --afterok",
+                   -1);
+    }
+    if (optind == argc) {
+      die_with_err(
+          "ERROR! Requested to run a command, but no command specified", -1);
+    }
+    return do_array(config, argc, optind, argv);
+  }
+
+  auto dependent = !config.get_string("after").empty() ||
+                   !config.get_string("afterok").empty();
+
+  if (dependent) {
+    if (rerun || !config.get_string("batch").empty()) {
+      die_with_err("ERROR! --after and --afterok cannot be combined with "
+                   "--rerun or --batch",
+                   -1);
+    }
+    if (optind == argc) {
+      die_with_err(
+          "ERROR! Requested to run a command, but no command specified", -1);
+    }
+    return do_dependent(config, argc, optind, argv);
+  }
+
+  if (!config.get_string("batch").empty()) {
+    if (rerun || optind != argc) {
+      die_with_err("ERROR! A command cannot be given alongside --batch", -1);
+    }
+    return do_batch(config);
+  }
+
+  if (!rerun) {
+    if (optind == argc) {
+      std::cerr << std::format(tsp::help, argv[0]) << std::endl;
+      die_with_err(
+          "ERROR! Requested to run a command, but no command specified", -1);
+    }
+  }
+
+  if (config.get_bool("do_fork")) {
+    auto main_fork_pid = pid_t{fork()};
+    if (main_fork_pid == -1) {
+      die_with_err("Unable to fork when forking requested", main_fork_pid);
+    }
+    if (main_fork_pid != 0) {
+      // We're done here
+      return 0;
+    }
+  }
+
+  auto stat = tsp::Status_Manager{};
+  apply_node_settings(config, stat);
+  auto cmd = rerun
+                 ? tsp::Run_cmd{stat.get_cmd_to_rerun(config.get_int("rerun"))}
+                 : tsp::Run_cmd{argv, optind, argc};
+  if (rerun) {
+    // This variant of add_cmd will recover category and nslots from the jobid
+    stat.add_cmd(cmd, config.get_int("rerun"));
+  } else {
+    stat.add_cmd(cmd, config.get_string("category"), config.get_int("nslots"));
+  }
+  for (const auto sig : signals_to_forward) {
+    signal(sig, sigintHandlerPreFork);
+  }
+  auto extern_jobid = stat.get_extern_jobid();
+  record_job_requests(config, stat, {extern_jobid});
+  std::cout << extern_jobid << std::endl;
+
+  auto ps = rerun ? stat.get_state(config.get_int("rerun"))
+                  : prog_state{std::filesystem::current_path(), {environ, {}}};
+  return run_job(config, stat, cmd, extern_jobid, ps, false);
+}
 } // namespace tsp
\ No newline at end of file
@@ -1,13 +1,27 @@
 #pragma once
 
+#include <cstdint>
+#include <optional>
+#include <sys/types.h>
+#include <vector>
+
 #include "generic_config.hpp"
 
 namespace tsp {
 
+class Status_Manager;
+
 class Spooler_config : public Generic_config {
 public:
   Spooler_config();
 };
 
 int do_spooler(Spooler_config conf, int argc, int optind, char *argv[]);
+// Start a tsp instance in the background to run each of the dependent jobs
+// in ids
+std::vector<pid_t> start_eligible_jobs(const std::vector<uint32_t> &ids);
+// Start a tsp instance in the background to run queued jobs and array
+// members if there are any and no live instance is already waiting to.
+// Also returns jobs claimed by dead instances to the queue.
+std::optional<pid_t> start_queue_runner(Status_Manager &stat);
 } // namespace tsp
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <sqlite3.h>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 
 #include "functions.hpp"
 
@@ -33,9 +34,50 @@ void exit_with_sqlite_err(std::string_view msg, int ret, sqlite3_stmt *stmt) {
   exit_with_sqlite_err(msg, ret, sql);
 }
 
+Sqlite_statement_cache::~Sqlite_statement_cache() { clear(); }
+
+void Sqlite_statement_cache::clear() {
+  for (auto &[key, entry] : stmts_) {
+    sqlite3_finalize(entry.stmt);
+  }
+  stmts_.clear();
+}
+
+Sqlite_statement_manager::Sqlite_statement_manager(
+    sqlite3 *conn, Sqlite_statement_cache &cache, std::string_view sql)
+    : sqlite_ret_(SQLITE_OK), conn_(conn), cache_entry_(nullptr) {
+  auto &entry = cache.stmts_[sql.data()];
+  if (entry.in_use) {
+    prepare(sql);
+    return;
+  }
+  // Guard against the address having been reused for different text
+  if (entry.stmt && std::string_view{sqlite3_sql(entry.stmt)} != sql) {
+    sqlite3_finalize(entry.stmt);
+    entry.stmt = nullptr;
+  }
+  if (!entry.stmt) {
+    prepare(sql);
+    entry.stmt = stmt_;
+  }
+  stmt_ = entry.stmt;
+  entry.in_use = true;
+  cache_entry_ = &entry;
+}
+
 Sqlite_statement_manager::Sqlite_statement_manager(sqlite3 *conn,
                                                    std::string_view sql)
-    : sqlite_ret_(SQLITE_OK), conn_(conn) {
+    : sqlite_ret_(SQLITE_OK), conn_(conn), cache_entry_(nullptr) {
+  prepare(sql);
+}
+
+void Sqlite_statement_manager::prepare(std::string_view sql) {
+  // e.g. a write through a manager inherited across fork_without_db()
+  if (conn_ == nullptr) {
+    exit_with_sqlite_err("No database connection for the following sql "
+                         "statement:",
+                         SQLITE_MISUSE, sql);
+  }
   if ((sqlite_ret_ = sqlite3_prepare_v2(conn_, sql.data(), sql.length(), &stmt_,
                                         nullptr)) != SQLITE_OK) {
     exit_with_sqlite_err(
@@ -44,9 +86,51 @@ Sqlite_statement_manager::Sqlite_statement_manager(sqlite3 *conn,
 }
 
 Sqlite_statement_manager::~Sqlite_statement_manager() {
-  if ((sqlite_ret_ = sqlite3_finalize(stmt_)) != SQLITE_OK) {
-    exit_with_sqlite_err("Unable finalize statement:", sqlite_ret_, stmt_);
-  };
+  if (!cache_entry_) {
+    if ((sqlite_ret_ = sqlite3_finalize(stmt_)) != SQLITE_OK) {
+      exit_with_sqlite_err("Unable finalize statement:", sqlite_ret_, stmt_);
+    };
+    return;
+  }
+  // Resetting also ends any read transaction the statement was holding
+  if ((sqlite_ret_ = sqlite3_reset(stmt_)) != SQLITE_OK) {
+    exit_with_sqlite_err("SQLite reset failed:", sqlite_ret_, stmt_);
+  }
+  sqlite3_clear_bindings(stmt_);
+  cache_entry_->in_use = false;
+}
+
+Sqlite_transaction::Sqlite_transaction(sqlite3 *conn)
+    : conn_(conn),
+      owner_(conn != nullptr && sqlite3_get_autocommit(conn) != 0) {
+  if (conn_ == nullptr) {
+    exit_with_sqlite_err("No database connection to begin a transaction on",
+                         SQLITE_MISUSE, nullptr);
+  }
+  if (!owner_) {
+    return;
+  }
+  int sqlite_ret;
+  char *sqlite_err;
+  if ((sqlite_ret = sqlite3_exec(conn_, "BEGIN IMMEDIATE;", nullptr, nullptr,
+                                 &sqlite_err)) != SQLITE_OK) {
+    exit_with_sqlite_err(sqlite_err, sqlite_ret, nullptr);
+  }
+}
+
+Sqlite_transaction::~Sqlite_transaction() { commit(); }
+
+void Sqlite_transaction::commit() {
+  if (!owner_) {
+    return;
+  }
+  owner_ = false;
+  int sqlite_ret;
+  char *sqlite_err;
+  if ((sqlite_ret = sqlite3_exec(conn_, "COMMIT;", nullptr, nullptr,
+                                 &sqlite_err)) != SQLITE_OK) {
+    exit_with_sqlite_err(sqlite_err, sqlite_ret, nullptr);
+  }
 }
 
 /*
@@ -117,6 +201,16 @@ void Sqlite_statement_manager::bind_param<sql_param_out>(
   }
 }
 
+template <>
+void Sqlite_statement_manager::bind_param<sql_param_out>(
+    int param_idx, std::optional<double> &val) {
+  val.reset();
+  auto tmp = sqlite3_column_text(stmt_, param_idx);
+  if (!!tmp) {
+    val.emplace(sqlite3_column_double(stmt_, param_idx));
+  }
+}
+
 template <>
 void Sqlite_statement_manager::bind_param<sql_param_out>(int param_idx,
                                                          double &val) {
@@ -134,7 +228,7 @@ void Sqlite_statement_manager::bind_param<sql_param_out>(
     int param_idx, std::optional<std::string> &val) {
   val.reset();
   auto tmp = sqlite3_column_text(stmt_, param_idx);
-  if (tmp[0] != '\0') {
+  if (tmp != nullptr && tmp[0] != '\0') {
     val.emplace(reinterpret_cast<const char *>(tmp));
   }
 }
@@ -172,6 +266,13 @@ void Sqlite_statement_manager::bind_param<sql_param_out>(
   }
   val.first[ntokens - 1] = nullptr;
 }
+template <>
+void Sqlite_statement_manager::bind_param<sql_param_out>(
+    int param_idx, std::vector<unsigned char> &val) {
+  auto data = static_cast<const unsigned char *>(
+      sqlite3_column_blob(stmt_, param_idx));
+  val.assign(data, data + sqlite3_column_bytes(stmt_, param_idx));
+}
 /*
 Input param specialisations
 */
@@ -250,6 +351,25 @@ void Sqlite_statement_manager::bind_param<sql_param_in>(int param_idx,
   }
 }
 
+template <>
+void Sqlite_statement_manager::bind_param<sql_param_in>(
+    int param_idx, std::optional<double> &val) {
+  if ((sqlite_ret_ = val ? sqlite3_bind_double(stmt_, param_idx, val.value())
+                         : sqlite3_bind_null(stmt_, param_idx)) != SQLITE_OK) {
+    die_with_err("Unable bind double in statement", sqlite_ret_);
+  }
+}
+
+template <>
+void Sqlite_statement_manager::bind_param<sql_param_in>(
+    int param_idx, std::vector<unsigned char> &val) {
+  if ((sqlite_ret_ = sqlite3_bind_blob(stmt_, param_idx, val.data(),
+                                       val.size(), SQLITE_TRANSIENT)) !=
+      SQLITE_OK) {
+    die_with_err("Unable bind blob in statement", sqlite_ret_);
+  }
+}
+
 template <>
 void Sqlite_statement_manager::bind_param<sql_param_in>(
     int param_idx, std::vector<std::string> &val) {
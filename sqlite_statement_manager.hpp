@@ -4,6 +4,7 @@
 #include <sqlite3.h>
 #include <string_view>
 #include <tuple>
+#include <unordered_map>
 
 #include <iostream>
 
@@ -14,8 +15,36 @@ constexpr int sql_param_in = 1;
 
 void exit_with_sqlite_err(std::string_view msg, int ret, std::string_view stmt);
 void exit_with_sqlite_err(std::string_view msg, int ret, sqlite3_stmt *stmt);
+// Prepared statements for one connection, owned by whatever owns the
+// connection and cleared before it is closed. Keyed on the address of the
+// SQL text: all SQL in tsp is a constexpr string_view, so the address
+// identifies the statement. Like the connection's owner, it is only used
+// by one thread at a time.
+class Sqlite_statement_cache {
+public:
+  Sqlite_statement_cache() = default;
+  ~Sqlite_statement_cache();
+  Sqlite_statement_cache(const Sqlite_statement_cache &) = delete;
+  Sqlite_statement_cache &operator=(const Sqlite_statement_cache &) = delete;
+  // Finalizes every statement, must be called before closing the connection
+  void clear();
+
+private:
+  friend class Sqlite_statement_manager;
+  struct entry {
+    sqlite3_stmt *stmt = nullptr;
+    bool in_use = false;
+  };
+  std::unordered_map<const char *, entry> stmts_;
+};
+
+// Statements taken from a cache are reset rather than finalized when the
+// manager goes out of scope. If the same statement is already in use, or
+// there is no cache, a one-off copy is prepared instead.
 class Sqlite_statement_manager {
 public:
+  Sqlite_statement_manager(sqlite3 *conn, Sqlite_statement_cache &cache,
+                           std::string_view sql);
   Sqlite_statement_manager(sqlite3 *conn, std::string_view sql);
   ~Sqlite_statement_manager();
   /*
@@ -74,6 +103,9 @@ private:
   int sqlite_ret_;
   sqlite3_stmt *stmt_;
   sqlite3 *conn_;
+  // Where stmt_ goes back to, null if it is a one-off
+  Sqlite_statement_cache::entry *cache_entry_;
+  void prepare(std::string_view sql);
   template <int I, typename T> void bind_param(int param_idx, T &val);
   template <int I, size_t J, typename... Targs>
   void bind_params(std::tuple<Targs...> &args) {
@@ -84,4 +116,20 @@ private:
     }
   }
 };
+
+// Holds a write transaction until it goes out of scope, or commit() is
+// called. BEGIN IMMEDIATE takes the write lock up front, so a transaction
+// only ever waits in the busy handler, never part way through. If a
+// transaction is already open on conn, this one joins it. Errors exit the
+// process, leaving sqlite to roll back whatever was in progress.
+class Sqlite_transaction {
+public:
+  explicit Sqlite_transaction(sqlite3 *conn);
+  ~Sqlite_transaction();
+  void commit();
+
+private:
+  sqlite3 *conn_;
+  bool owner_;
+};
 } // namespace tsp
\ No newline at end of file
@@ -1,8 +1,13 @@
 #include "status_manager.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <filesystem>
+#include <format>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
 #include <map>
 #include <random>
@@ -14,6 +19,7 @@
 
 #include "functions.hpp"
 #include "run_cmd.hpp"
+#include "slot_watcher.hpp"
 #include "sqlite_statement_manager.hpp"
 
 namespace tsp {
@@ -29,12 +35,44 @@ Status_Manager::Status_Manager(bool rw, bool die_on_open_fail)
   }
   open_db();
 }
+Status_Manager::Status_Manager(const std::string &uuid)
+    : jobid(uuid), rw_(true), die_on_open_fail_(true), total_slots_(0l),
+      slots_set_(false), started_(false), finished_(false), pid_(getpid()) {
+  // Adopt a job that was queued by another tsp instance
+  open_db();
+  auto out = Sqlite_statement_manager(conn_, stmts_, get_queued_job_stmt)
+                 .fetch_one<int32_t, uint64_t>(jobid);
+  slots_req_ = std::get<0>(out);
+  qtime = std::get<1>(out);
+}
 Status_Manager::Status_Manager(bool rw) : Status_Manager(rw, true) {};
 Status_Manager::Status_Manager() : Status_Manager(true, true) {};
-Status_Manager::~Status_Manager() {
+Status_Manager::~Status_Manager() { close_db(); }
+
+std::vector<Status_Manager *> Status_Manager::open_managers_;
+
+void Status_Manager::close_db() {
   if (conn_) {
+    stmts_.clear();
     sqlite3_close_v2(conn_);
+    conn_ = nullptr;
+    memprof_attached_ = false;
+    std::erase(open_managers_, this);
+  }
+}
+
+pid_t Status_Manager::fork_without_db() {
+  auto managers = open_managers_;
+  for (auto m : managers) {
+    m->close_db();
   }
+  auto pid = fork();
+  if (pid != 0) {
+    for (auto m : managers) {
+      m->open_db();
+    }
+  }
+  return pid;
 }
 
 void Status_Manager::set_total_slots(int32_t total_slots) {
@@ -44,11 +82,46 @@ void Status_Manager::set_total_slots(int32_t total_slots) {
         "Error! Attempted to set total number of available cores twice!", -1);
   }
   total_slots_ = total_slots;
-  Sqlite_statement_manager(conn_, create_integer_sequence_stmt)
+  Sqlite_statement_manager(conn_, stmts_, create_integer_sequence_stmt)
       .step(total_slots);
   slots_set_ = true;
 }
 
+// WAL lets readers carry on while others write, and with
+// synchronous=NORMAL a commit is an append to the log rather than a sync.
+// A database on PBS_JOBFS doesn't outlive the job, so
+// TSP_DB_SYNCHRONOUS=OFF loses nothing there. TSP_DB_JOURNAL_MODE is for
+// filesystems that can't provide the shared memory WAL needs.
+std::string db_pragmas(bool rw) {
+  auto from_env = [](const char *var, std::string_view fallback,
+                     std::initializer_list<std::string_view> allowed) {
+    std::string val{fallback};
+    if (auto env = std::getenv(var)) {
+      val = env;
+    }
+    std::transform(val.begin(), val.end(), val.begin(), ::toupper);
+    if (std::find(allowed.begin(), allowed.end(), val) == allowed.end()) {
+      die_with_err(std::format("ERROR! Invalid {}: {}", var, val), -1);
+    }
+    return val;
+  };
+  // foreign_keys is a no-op inside a transaction, so it can't go in
+  // db_initialise
+  auto out = std::format(
+      "PRAGMA foreign_keys = ON; PRAGMA synchronous = {}; PRAGMA mmap_size = "
+      "{};",
+      from_env("TSP_DB_SYNCHRONOUS", "NORMAL", {"OFF", "NORMAL", "FULL"}),
+      db_mmap_size);
+  // Changing the journal mode needs a write lock, and the setting sticks
+  if (rw) {
+    out += std::format(
+        " PRAGMA journal_mode = {};",
+        from_env("TSP_DB_JOURNAL_MODE", "WAL",
+                 {"WAL", "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "OFF"}));
+  }
+  return out;
+}
+
 void Status_Manager::open_db() {
   auto stat_fn = get_tmp() / db_name;
   int sqlite_ret;
@@ -67,52 +140,340 @@ void Status_Manager::open_db() {
       return;
     }
   }
+  open_managers_.push_back(this);
   // Wait a long time if we have to
   if ((sqlite_ret = sqlite3_busy_timeout(conn_, 10000)) != SQLITE_OK) {
     die_with_err("Unable to set busy timeout", sqlite_ret);
   }
   char *sqlite_err;
-  // Use exec here as db_initialise contains many statements.
+  if ((sqlite_ret = sqlite3_exec(conn_, db_pragmas(rw_).c_str(), nullptr,
+                                 nullptr, &sqlite_err)) != SQLITE_OK) {
+    exit_with_sqlite_err(sqlite_err, sqlite_ret, nullptr);
+  }
   if (rw_) {
-    if ((sqlite_ret = sqlite3_exec(conn_, db_initialise.data(), nullptr,
+    init_schema(conn_);
+  } else if (schema_version(conn_) != db_schema_version) {
+    // Reads would fail against an old schema, upgrade it through a
+    // connection of our own
+    sqlite3 *rw_conn;
+    if ((sqlite_ret = sqlite3_open_v2(stat_fn.c_str(), &rw_conn,
+                                      SQLITE_OPEN_FULLMUTEX |
+                                          SQLITE_OPEN_READWRITE,
+                                      nullptr)) != SQLITE_OK) {
+      die_with_err("Unable to open database to upgrade it", sqlite_ret);
+    }
+    sqlite3_busy_timeout(rw_conn, 10000);
+    if ((sqlite_ret = sqlite3_exec(rw_conn, db_pragmas(true).c_str(), nullptr,
                                    nullptr, &sqlite_err)) != SQLITE_OK) {
       exit_with_sqlite_err(sqlite_err, sqlite_ret, nullptr);
     }
+    init_schema(rw_conn);
+    sqlite3_close_v2(rw_conn);
   }
 }
 
+int32_t Status_Manager::schema_version(sqlite3 *conn) {
+  return Sqlite_statement_manager(conn, get_schema_version_stmt)
+      .fetch_one<int32_t>();
+}
+
+// Checking user_version before taking the write lock keeps the common
+// case of an up to date database lock-free. Everything happens in one
+// transaction so a concurrent tsp either sees the old schema or the new.
+void Status_Manager::init_schema(sqlite3 *conn) {
+  if (schema_version(conn) == db_schema_version) {
+    return;
+  }
+  auto txn = Sqlite_transaction{conn};
+  auto version = schema_version(conn);
+  if (version == db_schema_version) {
+    return;
+  }
+  if (version > db_schema_version) {
+    die_with_err(std::format("Database schema version {} is newer than this "
+                             "tsp supports ({})",
+                             version, db_schema_version),
+                 -1);
+  }
+  int sqlite_ret;
+  char *sqlite_err;
+  auto exec = [&](std::string_view sql) {
+    if ((sqlite_ret = sqlite3_exec(conn, sql.data(), nullptr, nullptr,
+                                   &sqlite_err)) != SQLITE_OK) {
+      exit_with_sqlite_err(sqlite_err, sqlite_ret, nullptr);
+    }
+  };
+  if (Sqlite_statement_manager(conn, has_legacy_times).fetch_one<int32_t>() >
+      0) {
+    exec(db_migrate_legacy_times);
+  }
+  // Use exec here as db_initialise contains many statements.
+  exec(db_initialise);
+  exec(std::format("PRAGMA user_version = {};", db_schema_version));
+}
+
 void Status_Manager::add_cmd(Run_cmd &cmd, std::string category,
                              int32_t slots) {
   if (!rw_) {
     die_with_err("Attempted to write to database in read-only mode!", -1);
   }
   slots_req_ = slots;
-  Sqlite_statement_manager(conn_, insert_cmd_stmt)
+  auto txn = Sqlite_transaction{conn_};
+  Sqlite_statement_manager(conn_, stmts_, insert_cmd_stmt)
       .step(jobid, cmd.print(), cmd.get(), category, pid_, slots_req_);
   qtime = now();
-  Sqlite_statement_manager(conn_, insert_qtime_stmt).step(qtime, jobid);
+  Sqlite_statement_manager(conn_, stmts_, set_qtime_stmt).step(qtime, jobid);
 }
 
 void Status_Manager::add_cmd(Run_cmd &cmd, uint32_t id) {
   if (!rw_) {
     die_with_err("Attempted to write to database in read-only mode!", -1);
   }
-  auto out = Sqlite_statement_manager(conn_, get_job_category_stmt)
+  auto out = Sqlite_statement_manager(conn_, stmts_, get_job_category_stmt)
                  .fetch_one<std::string, int32_t>(id);
   auto category = std::get<0>(out);
   slots_req_ = std::get<1>(out);
-  Sqlite_statement_manager(conn_, insert_cmd_stmt)
+  auto txn = Sqlite_transaction{conn_};
+  Sqlite_statement_manager(conn_, stmts_, insert_cmd_stmt)
       .step(jobid, cmd.print(), cmd.get(), category, pid_, slots_req_);
   qtime = now();
-  Sqlite_statement_manager(conn_, insert_qtime_stmt).step(qtime, jobid);
+  Sqlite_statement_manager(conn_, stmts_, set_qtime_stmt).step(qtime, jobid);
+}
+
+std::vector<uint32_t> Status_Manager::add_cmds(std::vector<Run_cmd> &cmds,
+                                               std::string category,
+                                               int32_t slots, prog_state &ps,
+                                               const std::string &config) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  // One transaction for the lot, rather than a sync per insert. Each job
+  // carries its config so any runner can start it, even if the ones
+  // started for this batch die.
+  auto txn = Sqlite_transaction{conn_};
+  std::vector<uint32_t> out;
+  auto cmd_ssm =
+      Sqlite_statement_manager(conn_, stmts_, insert_queued_cmd_stmt);
+  auto qtime_ssm = Sqlite_statement_manager(conn_, stmts_, set_qtime_stmt);
+  auto state_ssm =
+      Sqlite_statement_manager(conn_, stmts_, insert_start_state_stmt);
+  auto config_ssm =
+      Sqlite_statement_manager(conn_, stmts_, insert_job_config_stmt);
+  auto batch_qtime = now();
+  for (auto &cmd : cmds) {
+    auto uuid = gen_jobid();
+    cmd_ssm.step(uuid, cmd.print(), cmd.get(), category, slots);
+    out.push_back(static_cast<uint32_t>(sqlite3_last_insert_rowid(conn_)));
+    qtime_ssm.step(batch_qtime, uuid);
+    state_ssm.step(uuid, ps.wd, ps.env.first);
+    config_ssm.step(out.back(), config);
+  }
+  return out;
+}
+
+std::optional<uint32_t> Status_Manager::claim_queued_job() {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  // Another runner may claim the same job between the select and the
+  // update, in which case try the next one
+  for (;;) {
+    auto id = Sqlite_statement_manager(conn_, stmts_, get_unclaimed_job_stmt)
+                  .step<uint32_t>();
+    if (!id) {
+      return std::nullopt;
+    }
+    Sqlite_statement_manager(conn_, stmts_, claim_job_stmt)
+        .step(pid_, id.value());
+    if (sqlite3_changes(conn_) == 1) {
+      return id;
+    }
+  }
+}
+
+// Dependent jobs are queued without a waiting tsp instance, one is
+// started for them when their parents have finished. The job, its
+// dependencies and its config go in together so that no runner can claim
+// it before its dependencies are recorded.
+uint32_t Status_Manager::add_dependent_cmd(
+    Run_cmd &cmd, std::string category, int32_t slots, prog_state &ps,
+    const std::vector<uint32_t> &after, const std::vector<uint32_t> &afterok,
+    const std::string &config) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto txn = Sqlite_transaction{conn_};
+  auto uuid = gen_jobid();
+  Sqlite_statement_manager(conn_, stmts_, insert_queued_cmd_stmt)
+      .step(uuid, cmd.print(), cmd.get(), category, slots);
+  auto id = static_cast<uint32_t>(sqlite3_last_insert_rowid(conn_));
+  Sqlite_statement_manager(conn_, stmts_, set_qtime_stmt).step(now(), uuid);
+  Sqlite_statement_manager(conn_, stmts_, insert_start_state_stmt)
+      .step(uuid, ps.wd, ps.env.first);
+  add_dependencies(id, after, false);
+  add_dependencies(id, afterok, true);
+  Sqlite_statement_manager(conn_, stmts_, insert_job_config_stmt)
+      .step(id, config);
+  return id;
+}
+
+uint32_t Status_Manager::add_array(Run_cmd &cmd, std::string category,
+                                   int32_t slots, prog_state &ps,
+                                   int64_t first, int64_t last, int64_t step,
+                                   const std::string &config) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto txn = Sqlite_transaction{conn_};
+  Sqlite_statement_manager(conn_, stmts_, insert_array_stmt)
+      .step(cmd.print(), cmd.get(), category, slots, first, last, step, first,
+            ps.wd, ps.env.first, now());
+  auto id = static_cast<uint32_t>(sqlite3_last_insert_rowid(conn_));
+  Sqlite_statement_manager(conn_, stmts_, insert_array_config_stmt)
+      .step(id, config);
+  return id;
+}
+
+std::optional<uint32_t> Status_Manager::get_pending_array() {
+  if (db_not_openable()) {
+    return {};
+  }
+  return Sqlite_statement_manager(conn_, stmts_, get_pending_array_stmt)
+      .step<uint32_t>();
+}
+
+std::tuple<std::string, prog_state, std::string>
+Status_Manager::get_array_to_run(uint32_t array_id) {
+  if (db_not_openable()) {
+    return {};
+  }
+  auto [cmd, wd, env, config] =
+      Sqlite_statement_manager(conn_, stmts_, get_array_to_run_stmt)
+          .fetch_one<ptr_array_w_buffer_t, std::filesystem::path,
+                     ptr_array_w_buffer_t, std::string>(array_id);
+  // env's pointers are into its own buffer, so it has to be moved
+  return {cmd.second, prog_state{wd, std::move(env)}, config};
+}
+
+std::optional<int64_t> Status_Manager::claim_array_index(uint32_t array_id) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto txn = Sqlite_transaction{conn_};
+  auto idx = Sqlite_statement_manager(conn_, stmts_, get_next_array_index_stmt)
+                 .step<int64_t>(array_id);
+  if (idx) {
+    Sqlite_statement_manager(conn_, stmts_, bump_array_index_stmt)
+        .step(array_id);
+  }
+  return idx;
 }
 
-void Status_Manager::insert_proc_allocation() {
+// Members carry the array's config so that, like any other queued job, they
+// can be started by another runner if theirs dies first
+void Status_Manager::add_array_member(uint32_t array_id, int64_t idx,
+                                      const std::string &config) {
   if (!rw_) {
     die_with_err("Attempted to write to database in read-only mode!", -1);
   }
-  Sqlite_statement_manager(conn_, insert_proc_allocation_stmt)
-      .step(total_slots_, jobid, slots_req_, slots_req_);
+  auto txn = Sqlite_transaction{conn_};
+  Sqlite_statement_manager(conn_, stmts_, insert_array_member_stmt)
+      .step(array_id, idx, jobid);
+  Sqlite_statement_manager(conn_, stmts_, insert_job_config_stmt)
+      .step(get_extern_jobid(), config);
+}
+
+bool Status_Manager::claim_queued_job(uint32_t id) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  Sqlite_statement_manager(conn_, stmts_, claim_job_stmt).step(pid_, id);
+  return sqlite3_changes(conn_) == 1;
+}
+
+int64_t Status_Manager::count_unclaimed_jobs() {
+  if (db_not_openable()) {
+    return 0;
+  }
+  return Sqlite_statement_manager(conn_, stmts_, count_unclaimed_jobs_stmt)
+      .step<int64_t>()
+      .value_or(0);
+}
+
+bool Status_Manager::release_orphaned_jobs() {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  std::vector<std::tuple<uint32_t, pid_t>> claimed;
+  auto ssm =
+      Sqlite_statement_manager(conn_, stmts_, get_claimed_queued_jobs_stmt);
+  while (auto tmp = ssm.step<uint32_t, pid_t>()) {
+    claimed.push_back(tmp.value());
+  }
+  auto live_runner = false;
+  auto released = false;
+  for (const auto &[id, runner_pid] : claimed) {
+    if (process_is_alive(runner_pid)) {
+      live_runner = true;
+      continue;
+    }
+    auto txn = Sqlite_transaction{conn_};
+    Sqlite_statement_manager(conn_, stmts_, release_job_stmt)
+        .step(id, runner_pid);
+    if (sqlite3_changes(conn_) == 1) {
+      Sqlite_statement_manager(conn_, stmts_, release_job_slots_stmt).step(id);
+      released = true;
+    }
+  }
+  if (released) {
+    notify_slot_watchers();
+  }
+  return live_runner;
+}
+
+void Status_Manager::add_dependencies(uint32_t id,
+                                      const std::vector<uint32_t> &parents,
+                                      bool ok_only) {
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, insert_dep_stmt);
+  for (const auto parent : parents) {
+    ssm.step(id, static_cast<int32_t>(ok_only), parent);
+    if (sqlite3_changes(conn_) != 1) {
+      die_with_err(std::format("Error! Job {} does not exist", parent), -1);
+    }
+  }
+}
+
+void Status_Manager::cancel_failed_dependents() {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto ssm =
+      Sqlite_statement_manager(conn_, stmts_, cancel_failed_dependents_stmt);
+  do {
+    ssm.step(dependency_failed_status, now());
+  } while (sqlite3_changes(conn_) > 0);
+}
+
+
+int32_t Status_Manager::get_slots_required() { return slots_req_; }
+
+bool Status_Manager::insert_proc_allocation(
+    const std::vector<uint32_t> &slots) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  return insert_proc_allocation(jobid, slots);
+}
+
+bool Status_Manager::insert_proc_allocation(
+    const std::string &uuid, const std::vector<uint32_t> &slots) {
+  std::string slot_list{","};
+  for (const auto &s : slots) {
+    slot_list += std::to_string(s) + ",";
+  }
+  Sqlite_statement_manager(conn_, stmts_, insert_proc_allocation_stmt)
+      .step(uuid, slot_list);
+  return static_cast<size_t>(sqlite3_changes(conn_)) == slots.size();
 }
 
 void Status_Manager::job_start() {
@@ -120,7 +481,7 @@ void Status_Manager::job_start() {
     die_with_err("Attempted to write to database in read-only mode!", -1);
   }
   stime = now();
-  Sqlite_statement_manager(conn_, insert_stime_stmt).step(stime, jobid);
+  Sqlite_statement_manager(conn_, stmts_, set_stime_stmt).step(stime, jobid);
   started_ = true;
 }
 
@@ -128,35 +489,201 @@ void Status_Manager::job_end(int exit_stat) {
   if (!rw_) {
     die_with_err("Attempted to write to database in read-only mode!", -1);
   }
+  record_end(exit_stat);
+  // Our slots are free again, wake any jobs waiting on them
+  notify_slot_watchers();
+}
+
+void Status_Manager::job_end(
+    int exit_stat,
+    const std::pair<std::filesystem::path, std::filesystem::path> &output) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  save_output(output);
+  record_end(exit_stat);
+  notify_slot_watchers();
+}
+
+void Status_Manager::record_end(int exit_stat) {
+  auto txn = Sqlite_transaction{conn_};
   if (!started_) {
     job_start();
   }
   etime = now();
-  Sqlite_statement_manager(conn_, insert_etime_stmt)
+  Sqlite_statement_manager(conn_, stmts_, set_etime_stmt)
       .step(exit_stat, etime, jobid);
   finished_ = true;
+  cancel_failed_dependents();
 }
 
+// Each chunk is committed on its own so that other tsp instances aren't
+// locked out of the database while a large output is compressed. Readers
+// ignore them until record_end commits our etime, and read the output
+// file until then.
 void Status_Manager::save_output(
-    const std::pair<std::string, std::string> &in) {
+    const std::pair<std::filesystem::path, std::filesystem::path> &in) {
   if (!rw_) {
     die_with_err("Attempted to write to database in read-only mode!", -1);
   }
-  Sqlite_statement_manager(conn_, insert_output_stmt)
-      .step(jobid, in.first, in.second);
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, insert_output_chunk_stmt);
+  for (auto [fn, s] : {std::pair{in.first, OutputStream::out},
+                       std::pair{in.second, OutputStream::err}}) {
+    auto seq = int32_t{0};
+    compress_file_chunks(
+        fn, [&](int64_t bytes, const std::vector<unsigned char> &data) {
+          ssm.step(jobid, static_cast<int32_t>(s), seq++, bytes, data);
+        });
+  }
 }
 
 void Status_Manager::store_state(prog_state ps) {
   if (!rw_) {
     die_with_err("Attempted to write to database in read-only mode!", -1);
   }
-  Sqlite_statement_manager(conn_, insert_start_state_stmt)
+  Sqlite_statement_manager(conn_, stmts_, insert_start_state_stmt)
       .step(jobid, ps.wd, ps.env.first);
 }
 
+void Status_Manager::set_membind(std::string policy, std::string nodes) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  Sqlite_statement_manager(conn_, stmts_, insert_membind_stmt)
+      .step(jobid, policy, nodes);
+}
+
+void Status_Manager::set_cgroup(const std::string &path) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  Sqlite_statement_manager(conn_, stmts_, insert_cgroup_stmt).step(jobid, path);
+}
+
+void Status_Manager::set_est_time(const std::vector<uint32_t> &ids,
+                                  int64_t est_time) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto txn = Sqlite_transaction{conn_};
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, insert_est_time_stmt);
+  for (const auto id : ids) {
+    ssm.step(id, est_time);
+  }
+}
+
+void Status_Manager::set_priority(const std::vector<uint32_t> &ids,
+                                  int32_t priority) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto txn = Sqlite_transaction{conn_};
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, insert_priority_stmt);
+  for (const auto id : ids) {
+    ssm.step(id, priority);
+  }
+}
+
+void Status_Manager::set_mem(const std::vector<uint32_t> &ids,
+                             int64_t bytes) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto txn = Sqlite_transaction{conn_};
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, insert_mem_stmt);
+  for (const auto id : ids) {
+    ssm.step(id, bytes);
+  }
+}
+
+void Status_Manager::set_placement(const std::vector<uint32_t> &ids,
+                                   const std::string &distribution,
+                                   const std::string &smt) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  auto txn = Sqlite_transaction{conn_};
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, insert_placement_stmt);
+  for (const auto id : ids) {
+    ssm.step(id, distribution, smt);
+  }
+}
+
+void Status_Manager::set_mem_from_history(const std::vector<uint32_t> &ids) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  // No profiles, nothing to go on
+  if (!attach_memprof()) {
+    return;
+  }
+  {
+    auto txn = Sqlite_transaction{conn_};
+    auto ssm =
+        Sqlite_statement_manager(conn_, stmts_, insert_mem_from_history_stmt);
+    for (const auto id : ids) {
+      ssm.step(id);
+    }
+  }
+  detach_memprof();
+}
+
+void Status_Manager::set_node_setting(const std::string &name,
+                                      const std::string &value) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  Sqlite_statement_manager(conn_, stmts_, set_node_setting_stmt)
+      .step(name, value);
+}
+
+bool Status_Manager::set_node_setting_when_idle(const std::string &name,
+                                                const std::string &value) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  Sqlite_statement_manager(conn_, stmts_, set_node_setting_when_idle_stmt)
+      .step(name, value);
+  return sqlite3_changes(conn_) == 1;
+}
+
+void Status_Manager::set_node_setting_default(const std::string &name,
+                                              const std::string &value) {
+  if (!rw_) {
+    die_with_err("Attempted to write to database in read-only mode!", -1);
+  }
+  Sqlite_statement_manager(conn_, stmts_, set_node_setting_default_stmt)
+      .step(name, value);
+}
+
 /*
 Read-only functions
 */
+bool Status_Manager::attach_memprof() {
+  if (!memprof_attached_) {
+    auto memprof_fn = get_tmp() / memprof_db_name;
+    if (!std::filesystem::exists(memprof_fn)) {
+      return false;
+    }
+    Sqlite_statement_manager(conn_, stmts_, attach_memprof_stmt)
+        .step(memprof_fn.string());
+    memprof_attached_ = true;
+  }
+  if (Sqlite_statement_manager(conn_, stmts_, get_attached_memprof_version_stmt)
+          .fetch_one<int32_t>() != memprof_schema_version) {
+    detach_memprof();
+    return false;
+  }
+  return true;
+}
+
+void Status_Manager::detach_memprof() {
+  if (memprof_attached_) {
+    Sqlite_statement_manager(conn_, stmts_, detach_memprof_stmt).step();
+    memprof_attached_ = false;
+  }
+}
+
 bool Status_Manager::db_not_openable() {
   if (!conn_) {
     open_db();
@@ -170,7 +697,8 @@ std::vector<uint32_t> Status_Manager::recover_proc_allocation() {
     return {};
   }
   std::vector<uint32_t> out;
-  auto ssm = Sqlite_statement_manager(conn_, recover_proc_allocation_stmt);
+  auto ssm =
+      Sqlite_statement_manager(conn_, stmts_, recover_proc_allocation_stmt);
   while (auto tmp = ssm.step<uint32_t>(jobid)) {
     out.push_back(tmp.value());
   }
@@ -182,18 +710,162 @@ std::vector<pid_t> Status_Manager::get_running_job_pids(pid_t excl) {
     return {};
   }
   std::vector<pid_t> out;
-  auto ssm = Sqlite_statement_manager(conn_, get_sibling_pids_stmt);
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, get_sibling_pids_stmt);
   while (auto tmp = ssm.step<pid_t>(excl)) {
     out.push_back(tmp.value());
   }
   return out;
 }
 
+std::vector<uint32_t> Status_Manager::get_slots_in_use() {
+  if (db_not_openable()) {
+    return {};
+  }
+  std::vector<uint32_t> out;
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, get_slots_in_use_stmt);
+  while (auto tmp = ssm.step<uint32_t>()) {
+    out.push_back(tmp.value());
+  }
+  return out;
+}
+
+std::vector<waiting_job> Status_Manager::get_waiting_jobs() {
+  if (db_not_openable()) {
+    return {};
+  }
+  std::vector<waiting_job> out;
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, get_waiting_jobs_stmt);
+  while (auto tmp = ssm.step<uint32_t, std::string, int32_t, uint32_t,
+                             std::optional<int64_t>, int64_t, std::string,
+                             std::string>()) {
+    out.push_back(std::make_from_tuple<waiting_job>(tmp.value()));
+  }
+  return out;
+}
+
+std::vector<running_alloc> Status_Manager::get_running_allocations() {
+  if (db_not_openable()) {
+    return {};
+  }
+  std::vector<running_alloc> out;
+  auto ssm =
+      Sqlite_statement_manager(conn_, stmts_, get_running_allocations_stmt);
+  while (auto tmp = ssm.step<int32_t, std::optional<int64_t>,
+                             std::optional<int64_t>, int64_t>()) {
+    out.push_back(std::make_from_tuple<running_alloc>(tmp.value()));
+  }
+  return out;
+}
+
+std::optional<int32_t> Status_Manager::get_priority(uint32_t id) {
+  if (db_not_openable()) {
+    return {};
+  }
+  return Sqlite_statement_manager(conn_, stmts_, get_priority_stmt)
+      .step<int32_t>(id);
+}
+
+std::vector<array_stat> Status_Manager::get_array_stats() {
+  if (db_not_openable()) {
+    return {};
+  }
+  std::vector<array_stat> out;
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, get_array_stats_stmt);
+  while (auto tmp = ssm.step<uint32_t, std::string, std::optional<std::string>,
+                             int64_t, int64_t, int64_t, int64_t, int32_t,
+                             int32_t, int32_t>()) {
+    out.push_back(std::make_from_tuple<array_stat>(tmp.value()));
+  }
+  return out;
+}
+
+std::vector<job_stat>
+Status_Manager::get_array_member_stats(uint32_t array_id) {
+  if (db_not_openable()) {
+    return {};
+  }
+  std::vector<job_stat> out;
+  auto ssm =
+      Sqlite_statement_manager(conn_, stmts_, get_array_member_jobs_stmt);
+  while (auto tmp =
+             ssm.step<uint32_t, std::string, std::optional<std::string>,
+                      int64_t, std::optional<int64_t>, std::optional<int64_t>,
+                      std::optional<int32_t>>(array_id)) {
+    out.push_back(std::make_from_tuple<job_stat>(tmp.value()));
+  }
+  return out;
+}
+
+std::optional<std::tuple<uint32_t, int64_t>>
+Status_Manager::get_array_member(uint32_t id) {
+  if (db_not_openable()) {
+    return {};
+  }
+  return Sqlite_statement_manager(conn_, stmts_, get_array_member_stmt)
+      .step<uint32_t, int64_t>(id);
+}
+
+bool Status_Manager::job_is_eligible(uint32_t id) {
+  if (db_not_openable()) {
+    return false;
+  }
+  return Sqlite_statement_manager(conn_, stmts_, get_eligible_job_stmt)
+      .step<uint32_t>(id)
+      .has_value();
+}
+
+std::vector<uint32_t> Status_Manager::get_eligible_dependents() {
+  if (db_not_openable()) {
+    return {};
+  }
+  std::vector<uint32_t> out;
+  auto ssm =
+      Sqlite_statement_manager(conn_, stmts_, get_eligible_dependents_stmt);
+  while (auto tmp = ssm.step<uint32_t>()) {
+    out.push_back(tmp.value());
+  }
+  return out;
+}
+
+std::string Status_Manager::get_job_config(uint32_t id) {
+  if (db_not_openable()) {
+    return {};
+  }
+  return Sqlite_statement_manager(conn_, stmts_, get_job_config_stmt)
+      .step<std::string>(id)
+      .value_or(std::string());
+}
+
+std::string Status_Manager::get_node_setting(const std::string &name) {
+  if (db_not_openable()) {
+    return {};
+  }
+  return Sqlite_statement_manager(conn_, stmts_, get_node_setting_stmt)
+      .step<std::string>(name)
+      .value_or(std::string());
+}
+
+std::optional<int64_t> Status_Manager::get_mem(uint32_t id) {
+  if (db_not_openable()) {
+    return {};
+  }
+  return Sqlite_statement_manager(conn_, stmts_, get_mem_stmt)
+      .step<int64_t>(id);
+}
+
+std::optional<int64_t> Status_Manager::get_mem_budget() {
+  auto budget = get_node_setting("mem_budget");
+  if (budget.empty()) {
+    return std::nullopt;
+  }
+  return std::stoll(budget);
+}
+
 uint32_t Status_Manager::get_last_job_id() {
   if (db_not_openable()) {
     return {};
   }
-  return Sqlite_statement_manager(conn_, get_last_jobid_stmt)
+  return Sqlite_statement_manager(conn_, stmts_, get_last_jobid_stmt)
       .fetch_one<uint32_t>();
 }
 
@@ -202,7 +874,7 @@ job_stat Status_Manager::get_job_by_id(uint32_t id) {
     return {};
   }
   return std::make_from_tuple<job_stat>(
-      Sqlite_statement_manager(conn_, get_job_by_id_stmt)
+      Sqlite_statement_manager(conn_, stmts_, get_job_by_id_stmt)
           .fetch_one<uint32_t, std::string, std::optional<std::string>, int64_t,
                      std::optional<int64_t>, std::optional<int64_t>,
                      std::optional<int32_t>>(id));
@@ -235,7 +907,7 @@ Status_Manager::get_job_stats_by_category(ListCategory c) {
     stmt = get_finished_jobs_stmt;
     break;
   }
-  auto ssm = Sqlite_statement_manager(conn_, stmt);
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, stmt);
   std::vector<job_stat> out;
   while (auto tmp_stat =
              ssm.step<uint32_t, std::string, std::optional<std::string>,
@@ -251,12 +923,36 @@ std::map<uint32_t, double> Status_Manager::get_max_rss() {
     return {};
   }
   std::map<uint32_t, double> out;
-  if (Sqlite_statement_manager(conn_, has_memprof).fetch_one<int32_t>() == 1) {
-    auto ssm = Sqlite_statement_manager(conn_, get_max_rss_stmt);
-    while (auto tmp = ssm.step<uint32_t, double>()) {
-      out[std::get<0>(tmp.value())] = std::get<1>(tmp.value());
+  if (attach_memprof()) {
+    {
+      auto ssm = Sqlite_statement_manager(conn_, stmts_, get_max_rss_stmt);
+      while (auto tmp = ssm.step<uint32_t, double>()) {
+        out[std::get<0>(tmp.value())] = std::get<1>(tmp.value());
+      }
+    }
+    detach_memprof();
+  }
+  return out;
+}
+
+std::optional<job_usage> Status_Manager::get_job_usage(uint32_t id) {
+  if (db_not_openable()) {
+    return {};
+  }
+  if (!attach_memprof()) {
+    return {};
+  }
+  std::optional<job_usage> out;
+  {
+    auto tmp = Sqlite_statement_manager(conn_, stmts_, get_job_usage_stmt)
+                   .step<int64_t, uint64_t, uint64_t, uint64_t, uint64_t,
+                         uint64_t, uint64_t, uint64_t, std::optional<double>,
+                         std::optional<double>, std::optional<double>>(id);
+    if (tmp) {
+      out = std::make_from_tuple<job_usage>(tmp.value());
     }
   }
+  detach_memprof();
   return out;
 }
 
@@ -265,36 +961,73 @@ job_details Status_Manager::get_job_details_by_id(uint32_t id) {
     return {};
   }
   return std::make_from_tuple<job_details>(
-      Sqlite_statement_manager(conn_, get_job_details_by_id_stmt)
+      Sqlite_statement_manager(conn_, stmts_, get_job_details_by_id_stmt)
           .fetch_one<uint32_t, std::string, std::optional<std::string>, int64_t,
                      std::optional<int64_t>, std::optional<int64_t>,
                      std::optional<int32_t>, std::string, int32_t,
                      std::optional<uint32_t>>(id));
 }
 
-std::string Status_Manager::get_job_stdout(uint32_t id) {
+std::optional<std::pair<std::string, std::string>>
+Status_Manager::get_membind(uint32_t id) {
   if (db_not_openable()) {
     return {};
   }
-  return Sqlite_statement_manager(conn_, get_job_stdout_stmt)
-      .step<std::string>(id)
-      .value_or(std::string());
+  auto tmp = Sqlite_statement_manager(conn_, stmts_, get_membind_stmt)
+                 .step<std::string, std::string>(id);
+  if (!tmp) {
+    return {};
+  }
+  return std::make_pair(std::get<0>(tmp.value()), std::get<1>(tmp.value()));
 }
 
-std::string Status_Manager::get_job_stderr(uint32_t id) {
+std::optional<std::string> Status_Manager::get_cgroup(uint32_t id) {
   if (db_not_openable()) {
     return {};
   }
-  return Sqlite_statement_manager(conn_, get_job_stderr_stmt)
-      .step<std::string>(id)
-      .value_or(std::string());
+  return Sqlite_statement_manager(conn_, stmts_, get_cgroup_stmt)
+      .step<std::string>(id);
+}
+
+bool Status_Manager::print_job_output(uint32_t id, OutputStream s,
+                                      std::ostream &out, int64_t skip) {
+  if (db_not_openable()) {
+    return false;
+  }
+  auto found = false;
+  auto ssm = Sqlite_statement_manager(conn_, stmts_, get_output_chunks_stmt);
+  while (auto chunk = ssm.step<int64_t, std::vector<unsigned char>>(
+             id, static_cast<int32_t>(s))) {
+    found = true;
+    auto &[bytes, data] = chunk.value();
+    // Chunks that are skipped entirely needn't be decompressed
+    if (skip >= bytes) {
+      skip -= bytes;
+      continue;
+    }
+    decompress_chunk(bytes, data, skip, out);
+    skip = 0;
+  }
+  if (found) {
+    return true;
+  }
+  // Output stored as a single string by older versions of tsp
+  auto legacy = Sqlite_statement_manager(conn_, stmts_, s == OutputStream::out
+                                                    ? get_job_stdout_stmt
+                                                    : get_job_stderr_stmt)
+                    .step<std::string>(id)
+                    .value_or(std::string());
+  if (static_cast<size_t>(skip) < legacy.size()) {
+    out << legacy.substr(skip);
+  }
+  return !legacy.empty();
 }
 
 std::string Status_Manager::get_cmd_to_rerun(uint32_t id) {
   if (db_not_openable()) {
     return {};
   }
-  return Sqlite_statement_manager(conn_, get_cmd_to_rerun_stmt)
+  return Sqlite_statement_manager(conn_, stmts_, get_cmd_to_rerun_stmt)
       .fetch_one<ptr_array_w_buffer_t>(id)
       .second;
 }
@@ -303,7 +1036,7 @@ uint32_t Status_Manager::get_extern_jobid() {
   if (db_not_openable()) {
     return {};
   }
-  return Sqlite_statement_manager(conn_, get_extern_jobid_stmt)
+  return Sqlite_statement_manager(conn_, stmts_, get_extern_jobid_stmt)
       .fetch_one<uint32_t>(jobid);
 }
 
@@ -311,7 +1044,7 @@ std::string Status_Manager::get_job_uuid(uint32_t id) {
   if (db_not_openable()) {
     return {};
   }
-  return Sqlite_statement_manager(conn_, get_uuid_stmt)
+  return Sqlite_statement_manager(conn_, stmts_, get_uuid_stmt)
       .fetch_one<std::string>(id);
 }
 
@@ -320,7 +1053,7 @@ prog_state Status_Manager::get_state(uint32_t id) {
     return {};
   }
   return std::make_from_tuple<prog_state>(
-      Sqlite_statement_manager(conn_, get_state_stmt)
+      Sqlite_statement_manager(conn_, stmts_, get_state_stmt)
           .fetch_one<std::filesystem::path, ptr_array_w_buffer_t>(id));
 }
 
@@ -328,6 +1061,12 @@ std::string Status_Manager::gen_jobid() {
   // https://stackoverflow.com/questions/24365331/how-can-i-generate-uuid-in-c-without-using-boost-library
   static std::random_device rd;
   static std::mt19937 gen(rd());
+  // A forked child would otherwise repeat its parent's sequence
+  static auto seeded_pid = getpid();
+  if (getpid() != seeded_pid) {
+    gen.seed(rd());
+    seeded_pid = getpid();
+  }
   static std::uniform_int_distribution<> dis(0, 15);
   static std::uniform_int_distribution<> dis2(8, 11);
 
@@ -8,61 +8,167 @@
 #include <sqlite3.h>
 #include <string>
 #include <sys/types.h>
+#include <tuple>
 #include <unistd.h>
 #include <utility>
 
 #include "functions.hpp"
+#include "output_manager.hpp"
 #include "run_cmd.hpp"
+#include "sqlite_statement_manager.hpp"
 
 namespace tsp {
 constexpr std::string_view db_name("tsp_db.sqlite3");
+// Written by memprof alone, so profiling never contends for the job
+// database's write lock
+constexpr std::string_view memprof_db_name("tsp_memprof.sqlite3");
+// Stored in PRAGMA user_version of the memprof database
+constexpr int32_t memprof_schema_version{3};
+constexpr int64_t db_mmap_size{256ll << 20};
+// Stored in PRAGMA user_version. Bump it whenever existing databases need
+// migrating to match db_initialise.
+constexpr int32_t db_schema_version{5};
 constexpr std::string_view db_initialise(
-    // Ensure foreign keys are respected
-    "PRAGMA foreign_keys = ON;"
-    // Create command table
+    // Create command table. Timestamps and exit status live on the job
+    // itself so listing jobs needs no joins.
     "CREATE TABLE IF NOT EXISTS jobs (id INTEGER PRIMARY KEY AUTOINCREMENT, "
     "uuid TEXT UNIQUE, command TEXT, command_raw BLOB, category TEXT, pid "
-    "INTEGER, slots INTEGER);"
-    // Create queue time table
-    "CREATE TABLE IF NOT EXISTS qtime (id INTEGER PRIMARY KEY AUTOINCREMENT, "
-    "jobid INTEGER NOT NULL, time INTEGER, FOREIGN KEY(jobid) REFERENCES "
-    "jobs(id) ON DELETE CASCADE);"
-    // Create start time table
-    "CREATE TABLE IF NOT EXISTS stime (id INTEGER PRIMARY KEY AUTOINCREMENT, "
-    "jobid INTEGER NOT NULL, time INTEGER, FOREIGN KEY(jobid) REFERENCES "
-    "jobs(id) ON DELETE CASCADE);"
+    "INTEGER, slots INTEGER, qtime INTEGER, stime INTEGER, etime INTEGER, "
+    "exit_status INTEGER);"
     // Create start_state table
     "CREATE TABLE IF NOT EXISTS start_state (jobid INTEGER UNIQUE NOT NULL, "
     "cwd TEXT, environ BLOB, FOREIGN KEY(jobid) REFERENCES jobs(id) ON DELETE "
     "CASCADE);"
-    // Create end time table
-    "CREATE TABLE IF NOT EXISTS etime (id INTEGER PRIMARY KEY AUTOINCREMENT,  "
-    "jobid INTEGER NOT NULL, exit_status INTEGER, time INTEGER, FOREIGN "
-    "KEY(jobid) REFERENCES jobs(id) ON DELETE CASCADE);"
-    // Create stdout/stderr table
+    // Create stdout/stderr table. Only read for jobs that finished before
+    // output was stored in job_output_chunks.
     "CREATE TABLE IF NOT EXISTS job_output ( jobid INTEGER UNIQUE NOT NULL, "
     "stdout TEXT, stderr TEXT, FOREIGN KEY(jobid) REFERENCES jobs(id) ON "
     "DELETE CASCADE);"
+    // Create job_output_chunks table. stream is 0 for stdout, 1 for stderr,
+    // bytes is the uncompressed length of data
+    "CREATE TABLE IF NOT EXISTS job_output_chunks ( jobid INTEGER NOT NULL, "
+    "stream INTEGER NOT NULL, seq INTEGER NOT NULL, bytes INTEGER, data "
+    "BLOB, UNIQUE(jobid,stream,seq), FOREIGN KEY(jobid) REFERENCES jobs(id) "
+    "ON DELETE CASCADE);"
+    // Create job_membind table
+    "CREATE TABLE IF NOT EXISTS job_membind (jobid INTEGER UNIQUE NOT NULL, "
+    "policy TEXT, nodes TEXT, FOREIGN KEY(jobid) REFERENCES jobs(id) ON "
+    "DELETE CASCADE);"
+    // Create job_cgroup table, only for jobs run under TSP_CGROUP_ROOT
+    "CREATE TABLE IF NOT EXISTS job_cgroup (jobid INTEGER UNIQUE NOT NULL, "
+    "path TEXT, FOREIGN KEY(jobid) REFERENCES jobs(id) ON DELETE CASCADE);"
+    // Create job_estimates table
+    "CREATE TABLE IF NOT EXISTS job_estimates (jobid INTEGER UNIQUE NOT NULL, "
+    "est_time INTEGER, FOREIGN KEY(jobid) REFERENCES jobs(id) ON DELETE "
+    "CASCADE);"
+    // Create job_priority table
+    "CREATE TABLE IF NOT EXISTS job_priority (jobid INTEGER UNIQUE NOT NULL, "
+    "priority INTEGER, FOREIGN KEY(jobid) REFERENCES jobs(id) ON DELETE "
+    "CASCADE);"
+    // Create job_mem table
+    "CREATE TABLE IF NOT EXISTS job_mem (jobid INTEGER UNIQUE NOT NULL, "
+    "bytes INTEGER, FOREIGN KEY(jobid) REFERENCES jobs(id) ON DELETE "
+    "CASCADE);"
+    // Create job_placement table, only for jobs with non-default policies
+    "CREATE TABLE IF NOT EXISTS job_placement (jobid INTEGER UNIQUE NOT "
+    "NULL, distribution TEXT, smt TEXT, FOREIGN KEY(jobid) REFERENCES "
+    "jobs(id) ON DELETE CASCADE);"
+    // Create job_deps table
+    "CREATE TABLE IF NOT EXISTS job_deps (jobid INTEGER NOT NULL, parent "
+    "INTEGER NOT NULL, ok_only INTEGER, FOREIGN KEY(jobid) REFERENCES "
+    "jobs(id) ON DELETE CASCADE);"
+    // Create job_config table
+    "CREATE TABLE IF NOT EXISTS job_config (jobid INTEGER UNIQUE NOT NULL, "
+    "config TEXT, FOREIGN KEY(jobid) REFERENCES jobs(id) ON DELETE CASCADE);"
+    // Create arrays table. One row per array job, members only get a row
+    // in jobs when they are started
+    "CREATE TABLE IF NOT EXISTS arrays (id INTEGER PRIMARY KEY AUTOINCREMENT, "
+    "command TEXT, command_raw BLOB, category TEXT, slots INTEGER, first "
+    "INTEGER, last INTEGER, step INTEGER, next INTEGER, cwd TEXT, environ "
+    "BLOB, qtime INTEGER);"
+    // Create array_members table
+    "CREATE TABLE IF NOT EXISTS array_members (jobid INTEGER UNIQUE NOT NULL, "
+    "array_id INTEGER NOT NULL, idx INTEGER, FOREIGN KEY(jobid) REFERENCES "
+    "jobs(id) ON DELETE CASCADE);"
+    // Create array_config table. Options the array was submitted with, so
+    // any runner can start its members.
+    "CREATE TABLE IF NOT EXISTS array_config (array_id INTEGER UNIQUE NOT "
+    "NULL, config TEXT);"
+    // Create node_settings table
+    "CREATE TABLE IF NOT EXISTS node_settings( name TEXT UNIQUE NOT NULL, "
+    "value TEXT );"
     // Create integer_sequence table
     "CREATE TABLE IF NOT EXISTS integer_sequence( slot INTEGER UNIQUE );"
-    // Create used_slots table
+    // Create used_slots table. Rows are kept for finished jobs, released
+    // is set when the job ends so live allocations have their own index.
     "CREATE TABLE IF NOT EXISTS used_slots( uuid TEXT NOT NULL, slot INTEGER, "
-    "FOREIGN KEY(uuid) REFERENCES jobs(uuid) ON DELETE CASCADE);"
+    "released INTEGER, FOREIGN KEY(uuid) REFERENCES jobs(uuid) ON DELETE "
+    "CASCADE);"
+    "CREATE TRIGGER IF NOT EXISTS release_slots AFTER UPDATE OF etime ON jobs "
+    "WHEN NEW.etime IS NOT NULL BEGIN UPDATE used_slots SET released = 1 "
+    "WHERE uuid = NEW.uuid AND released IS NULL; END;"
+    // Create indexes
+    "CREATE INDEX IF NOT EXISTS jobs_unfinished ON jobs(stime) WHERE etime IS "
+    "NULL;"
+    "CREATE INDEX IF NOT EXISTS jobs_category ON jobs(category);"
+    "CREATE INDEX IF NOT EXISTS jobs_command ON jobs(command);"
+    "CREATE INDEX IF NOT EXISTS jobs_qtime ON jobs(qtime);"
+    "CREATE INDEX IF NOT EXISTS used_slots_live ON used_slots(uuid,slot) "
+    "WHERE released IS NULL;"
+    "CREATE INDEX IF NOT EXISTS job_deps_jobid ON job_deps(jobid);"
+    "CREATE INDEX IF NOT EXISTS job_deps_parent ON job_deps(parent);"
+    "CREATE INDEX IF NOT EXISTS array_members_array_id ON "
+    "array_members(array_id,idx);"
     // Create job_details view
-    "CREATE VIEW IF NOT EXISTS job_details AS SELECT jobs.id AS "
-    "id,uuid,command,category,pid,slots,qtime.time AS qtime,"
-    "stime.time AS stime,etime.time AS etime,etime.exit_status "
-    "AS exit_status FROM jobs LEFT JOIN qtime ON "
-    "jobs.id=qtime.jobid LEFT JOIN stime ON jobs.id=stime.jobid "
-    "LEFT JOIN etime ON jobs.id=etime.jobid;"
+    "CREATE VIEW IF NOT EXISTS job_details AS SELECT id,uuid,command,"
+    "category,pid,slots,qtime,stime,etime,exit_status FROM jobs;"
     // Create slots_in_use view
-    "CREATE VIEW IF NOT EXISTS slots_in_use AS SELECT used_slots.uuid AS "
-    "uuid,slot FROM jobs LEFT JOIN used_slots ON jobs.uuid = used_slots.uuid "
-    "LEFT JOIN etime ON jobs.id = etime.jobid WHERE etime.time IS NULL;"
+    "CREATE VIEW IF NOT EXISTS slots_in_use AS SELECT uuid,slot FROM "
+    "used_slots WHERE released IS NULL;"
+    // Create job_est_time view. Without a hint, assume a job takes as long
+    // as the longest successful run of the same command
+    "CREATE VIEW IF NOT EXISTS job_est_time AS SELECT jobs.id AS id,"
+    "COALESCE(job_estimates.est_time,( SELECT MAX(etime - stime) FROM "
+    "jobs AS hist WHERE hist.command = jobs.command AND hist.exit_status = 0 "
+    ")) AS est_time FROM jobs LEFT JOIN job_estimates ON jobs.id = "
+    "job_estimates.jobid;"
+    // Create unmet_deps view
+    "CREATE VIEW IF NOT EXISTS unmet_deps AS SELECT job_deps.jobid AS jobid "
+    "FROM job_deps JOIN jobs AS p ON job_deps.parent = p.id WHERE p.etime IS "
+    "NULL OR ( job_deps.ok_only AND p.exit_status != 0 );"
     // Create sibling_pids view
     "CREATE VIEW IF NOT EXISTS sibling_pids AS SELECT id,pid FROM jobs WHERE "
-    "id IN ( SELECT id FROM job_details WHERE stime IS NOT NULL and etime IS "
-    "NULL);");
+    "stime IS NOT NULL AND etime IS NULL;");
+
+// Moves timestamps from the qtime/stime/etime tables of unversioned
+// databases onto jobs. The old views refer to those tables so they go
+// too, db_initialise recreates them.
+constexpr std::string_view db_migrate_legacy_times(
+    "ALTER TABLE jobs ADD COLUMN qtime INTEGER;"
+    "ALTER TABLE jobs ADD COLUMN stime INTEGER;"
+    "ALTER TABLE jobs ADD COLUMN etime INTEGER;"
+    "ALTER TABLE jobs ADD COLUMN exit_status INTEGER;"
+    "UPDATE jobs SET qtime = ( SELECT time FROM qtime WHERE jobid = jobs.id "
+    "), stime = ( SELECT time FROM stime WHERE jobid = jobs.id ), etime = ( "
+    "SELECT time FROM etime WHERE jobid = jobs.id ), exit_status = ( SELECT "
+    "exit_status FROM etime WHERE jobid = jobs.id );"
+    "ALTER TABLE used_slots ADD COLUMN released INTEGER;"
+    "UPDATE used_slots SET released = 1 WHERE uuid IN ( SELECT uuid FROM jobs "
+    "WHERE etime IS NOT NULL );"
+    "DROP VIEW IF EXISTS job_details;"
+    "DROP VIEW IF EXISTS slots_in_use;"
+    "DROP VIEW IF EXISTS job_est_time;"
+    "DROP VIEW IF EXISTS unmet_deps;"
+    "DROP VIEW IF EXISTS sibling_pids;"
+    "DROP TABLE qtime;"
+    "DROP TABLE stime;"
+    "DROP TABLE etime;");
+
+constexpr std::string_view get_schema_version_stmt("PRAGMA user_version;");
+
+constexpr std::string_view has_legacy_times(
+    "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = "
+    "'qtime';");
 
 // Clean old entries
 constexpr std::string_view clean(
@@ -70,6 +176,9 @@ constexpr std::string_view clean(
     "PRAGMA foreign_keys = ON; "
     // Remove all jobs
     "DELETE FROM jobs; "
+    // Remove all arrays
+    "DELETE FROM arrays; "
+    "DELETE FROM array_config; "
     // Reset sequences
     "DELETE FROM integer_sequence; "
     "DELETE FROM sqlite_sequence;");
@@ -83,51 +192,250 @@ constexpr std::string_view insert_cmd_stmt(
     "INSERT INTO jobs(uuid,command,command_raw,category,pid,slots) VALUES "
     "(?,?,?,?,?,?);");
 
+// Jobs queued without a waiting tsp instance have a NULL pid until a
+// runner claims them
+constexpr std::string_view insert_queued_cmd_stmt(
+    "INSERT INTO jobs(uuid,command,command_raw,category,slots) VALUES "
+    "(?,?,?,?,?);");
+
+constexpr std::string_view get_unclaimed_job_stmt(
+    "SELECT id FROM jobs LEFT JOIN job_priority ON jobs.id = "
+    "job_priority.jobid WHERE pid IS NULL AND etime IS NULL AND NOT EXISTS ( "
+    "SELECT 1 FROM unmet_deps WHERE jobid = jobs.id ) ORDER BY "
+    "COALESCE(priority,0) DESC, id ASC LIMIT 1;");
+
+constexpr std::string_view count_unclaimed_jobs_stmt(
+    "SELECT COUNT(*) FROM jobs WHERE pid IS NULL AND etime IS NULL AND NOT "
+    "EXISTS ( SELECT 1 FROM unmet_deps WHERE jobid = jobs.id );");
+
+constexpr std::string_view claim_job_stmt(
+    "UPDATE jobs SET pid = ? WHERE id = ? AND pid IS NULL AND etime IS NULL "
+    "AND NOT EXISTS ( SELECT 1 FROM unmet_deps WHERE jobid = jobs.id );");
+
+// Queued jobs claimed by a runner that hasn't started them yet
+constexpr std::string_view get_claimed_queued_jobs_stmt(
+    "SELECT id,pid FROM jobs JOIN job_config ON jobs.id = job_config.jobid "
+    "WHERE pid IS NOT NULL AND stime IS NULL AND etime IS NULL;");
+
+constexpr std::string_view release_job_stmt(
+    "UPDATE jobs SET pid = NULL WHERE id = ? AND pid = ? AND stime IS NULL "
+    "AND etime IS NULL;");
+
+// A runner can die after it was allocated slots but before its job started
+constexpr std::string_view release_job_slots_stmt(
+    "UPDATE used_slots SET released = 1 WHERE uuid = ( SELECT uuid FROM jobs "
+    "WHERE id = ? ) AND released IS NULL;");
+
+constexpr std::string_view insert_dep_stmt(
+    "INSERT INTO job_deps(jobid,parent,ok_only) SELECT ?,id,? FROM jobs "
+    "WHERE id = ?;");
+
+// Repeated until nothing changes, to cancel whole chains of dependents
+constexpr std::string_view cancel_failed_dependents_stmt(
+    "UPDATE jobs SET exit_status = ?, etime = ? WHERE etime IS NULL AND "
+    "EXISTS ( SELECT 1 FROM job_deps JOIN jobs AS p ON job_deps.parent = p.id "
+    "WHERE job_deps.jobid = jobs.id AND job_deps.ok_only AND p.exit_status != "
+    "0 );");
+
+constexpr std::string_view get_eligible_job_stmt(
+    "SELECT id FROM jobs WHERE id = ? AND pid IS NULL AND etime IS NULL AND "
+    "NOT EXISTS ( SELECT 1 FROM unmet_deps WHERE jobid = jobs.id );");
+
+// Every dependent job on the node that could start now, not only those of
+// the job that just ended. Cancelling a job can make dependents of the
+// cancelled job eligible further down a chain.
+constexpr std::string_view get_eligible_dependents_stmt(
+    "SELECT DISTINCT id FROM jobs JOIN job_deps ON jobs.id = job_deps.jobid "
+    "WHERE pid IS NULL AND etime IS NULL AND NOT EXISTS ( SELECT 1 FROM "
+    "unmet_deps WHERE unmet_deps.jobid = jobs.id );");
+
+constexpr std::string_view insert_job_config_stmt(
+    "INSERT OR REPLACE INTO job_config(jobid,config) VALUES (?,?);");
+
+constexpr std::string_view
+    get_job_config_stmt("SELECT config FROM job_config WHERE jobid = ?;");
+
+constexpr std::string_view get_queued_job_stmt(
+    "SELECT slots,qtime FROM job_details WHERE uuid = ?;");
+
+// Only succeeds if every slot in the comma-delimited list is still free,
+// and the memory reserved by running jobs plus ours fits in the node's
+// budget, so concurrent allocations never clobber one another
 constexpr std::string_view insert_proc_allocation_stmt(
-    "WITH avail_slots AS ( SELECT seq.slot FROM integer_sequence seq LEFT JOIN "
-    "slots_in_use si ON seq.slot = si.slot WHERE si.slot IS NULL AND seq.slot "
-    "< ?) INSERT INTO used_slots(uuid,slot) SELECT ?,slot FROM avail_slots "
-    "WHERE ( SELECT COUNT(*) FROM avail_slots ) >= ? ORDER BY slot ASC LIMIT "
-    "?;");
+    "INSERT INTO used_slots(uuid,slot) SELECT ?1,slot FROM integer_sequence "
+    "WHERE instr(?2, ','||slot||',') > 0 AND NOT EXISTS ( SELECT 1 FROM "
+    "slots_in_use WHERE instr(?2, ','||slot||',') > 0 ) AND ( SELECT "
+    "COALESCE(SUM(bytes),0) FROM jobs JOIN job_mem ON job_mem.jobid = jobs.id "
+    "WHERE jobs.uuid IN ( SELECT uuid FROM slots_in_use UNION SELECT ?1 ) ) "
+    "<= COALESCE(( SELECT CAST(value AS INTEGER) FROM node_settings WHERE "
+    "name = 'mem_budget' ),9223372036854775807);");
+
+constexpr std::string_view
+    get_slots_in_use_stmt("SELECT slot FROM slots_in_use WHERE slot IS NOT "
+                          "NULL;");
 
 constexpr std::string_view recover_proc_allocation_stmt(
     "SELECT slot FROM slots_in_use WHERE uuid = ?;");
 
-constexpr std::string_view insert_qtime_stmt(
-    "INSERT INTO qtime(jobid,time) SELECT id,? FROM jobs WHERE uuid = ?;");
+constexpr std::string_view
+    get_node_setting_stmt("SELECT value FROM node_settings WHERE name = ?;");
+
+// Settings that change the meaning of slot numbers can only be changed
+// while no slots are allocated
+// Idle means no job is running or waiting to, including array members
+// that have yet to be started
+constexpr std::string_view set_node_setting_when_idle_stmt(
+    "INSERT OR REPLACE INTO node_settings(name,value) SELECT ?,? WHERE NOT "
+    "EXISTS ( SELECT 1 FROM jobs WHERE etime IS NULL ) AND NOT EXISTS ( "
+    "SELECT 1 FROM arrays WHERE next <= last );");
+
+constexpr std::string_view set_node_setting_default_stmt(
+    "INSERT OR IGNORE INTO node_settings(name,value) VALUES (?,?);");
+
+constexpr std::string_view insert_placement_stmt(
+    "INSERT OR REPLACE INTO job_placement(jobid,distribution,smt) VALUES "
+    "(?,?,?);");
+
+constexpr std::string_view insert_mem_stmt(
+    "INSERT OR REPLACE INTO job_mem(jobid,bytes) VALUES (?,?);");
+
+// Peak RSS (kB) of previous runs of the same command, or failing that
+// the same label. Only prepared when memprof_summary is attached.
+constexpr std::string_view insert_mem_from_history_stmt(
+    "INSERT OR REPLACE INTO job_mem(jobid,bytes) SELECT id,COALESCE(( SELECT "
+    "MAX(max_rss) FROM memprof_summary JOIN jobs AS hist ON "
+    "memprof_summary.jobid = hist.id WHERE hist.command = jobs.command ),( "
+    "SELECT MAX(max_rss) FROM memprof_summary JOIN jobs AS hist ON "
+    "memprof_summary.jobid = hist.id WHERE hist.category = jobs.category )) * "
+    "1024 FROM jobs WHERE id = ?;");
 
-constexpr std::string_view insert_stime_stmt(
-    "INSERT INTO stime(jobid,time) SELECT id,? FROM jobs WHERE uuid = ?;");
+constexpr std::string_view
+    get_mem_stmt("SELECT bytes FROM job_mem WHERE jobid = ? AND bytes IS NOT "
+                 "NULL;");
+
+constexpr std::string_view insert_est_time_stmt(
+    "INSERT OR REPLACE INTO job_estimates(jobid,est_time) VALUES (?,?);");
+
+constexpr std::string_view insert_priority_stmt(
+    "INSERT OR REPLACE INTO job_priority(jobid,priority) VALUES (?,?);");
+
+// Jobs with a tsp instance waiting for slots, in the order they should
+// get them. Highest priority first, then with fair-share on, labels
+// holding the fewest slots, then oldest first.
+constexpr std::string_view get_waiting_jobs_stmt(
+    "SELECT job_details.id,uuid,slots,pid,est_time,COALESCE(bytes,0),"
+    "COALESCE(distribution,'compact'),COALESCE(smt,'use') FROM job_details "
+    "JOIN job_est_time ON job_details.id = job_est_time.id LEFT JOIN "
+    "job_priority ON job_details.id = job_priority.jobid LEFT JOIN job_mem ON "
+    "job_details.id = job_mem.jobid LEFT JOIN job_placement ON "
+    "job_details.id = job_placement.jobid WHERE pid IS NOT NULL AND stime "
+    "IS NULL AND etime IS NULL AND uuid NOT IN ( SELECT uuid FROM "
+    "slots_in_use ) ORDER BY COALESCE(priority,0) DESC, CASE WHEN ( SELECT value FROM "
+    "node_settings WHERE name = 'fair_share' ) = 'on' THEN ( SELECT COUNT(*) "
+    "FROM slots_in_use JOIN jobs AS j ON slots_in_use.uuid = j.uuid WHERE "
+    "slot IS NOT NULL AND j.category IS job_details.category ) ELSE 0 END "
+    "ASC, job_details.id ASC;");
 
 constexpr std::string_view
-    insert_etime_stmt("INSERT INTO etime(jobid,exit_status,time) SELECT "
-                      "id,?,? FROM jobs WHERE uuid = ?;");
+    get_priority_stmt("SELECT priority FROM job_priority WHERE jobid = ?;");
+
+constexpr std::string_view set_node_setting_stmt(
+    "INSERT OR REPLACE INTO node_settings(name,value) VALUES (?,?);");
 
-constexpr std::string_view insert_output_stmt(
-    "INSERT INTO job_output(jobid,stdout,stderr) VALUES (( SELECT id "
-    "FROM jobs WHERE uuid = ? ),?,?);");
+constexpr std::string_view get_running_allocations_stmt(
+    "SELECT COUNT(*),stime,est_time,COALESCE(MAX(bytes),0) FROM slots_in_use "
+    "JOIN jobs ON slots_in_use.uuid = jobs.uuid JOIN job_est_time ON jobs.id "
+    "= job_est_time.id LEFT JOIN job_mem ON jobs.id = job_mem.jobid WHERE "
+    "slot IS NOT NULL GROUP BY jobs.id;");
+
+constexpr std::string_view
+    set_qtime_stmt("UPDATE jobs SET qtime = ? WHERE uuid = ?;");
+
+constexpr std::string_view
+    set_stime_stmt("UPDATE jobs SET stime = ? WHERE uuid = ?;");
+
+constexpr std::string_view set_etime_stmt(
+    "UPDATE jobs SET exit_status = ?, etime = ? WHERE uuid = ?;");
+
+constexpr std::string_view insert_output_chunk_stmt(
+    "INSERT INTO job_output_chunks(jobid,stream,seq,bytes,data) VALUES (( "
+    "SELECT id FROM jobs WHERE uuid = ? ),?,?,?,?);");
 
 constexpr std::string_view insert_start_state_stmt(
     "INSERT INTO start_state(jobid,cwd,environ) VALUES (( SELECT id FROM jobs "
     "WHERE uuid = ? ),?,?);");
 
+constexpr std::string_view insert_membind_stmt(
+    "INSERT INTO job_membind(jobid,policy,nodes) VALUES (( SELECT id FROM "
+    "jobs WHERE uuid = ? ),?,?);");
+
+constexpr std::string_view
+    get_membind_stmt("SELECT policy,nodes FROM job_membind WHERE jobid = ?;");
+
+constexpr std::string_view insert_cgroup_stmt(
+    "INSERT OR REPLACE INTO job_cgroup(jobid,path) VALUES (( SELECT id FROM "
+    "jobs WHERE uuid = ? ),?);");
+
+constexpr std::string_view
+    get_cgroup_stmt("SELECT path FROM job_cgroup WHERE jobid = ?;");
+
 constexpr std::string_view
     get_job_category_stmt("SELECT category,slots FROM jobs WHERE id = ?;");
 
 constexpr std::string_view
     get_sibling_pids_stmt("SELECT pid FROM sibling_pids WHERE pid != ?;");
 
-constexpr std::string_view
-    get_last_jobid_stmt("SELECT jobs.id FROM jobs LEFT JOIN qtime ON "
-                        "jobid = jobs.id ORDER BY time DESC LIMIT 1;");
+constexpr std::string_view get_last_jobid_stmt(
+    "SELECT id FROM jobs ORDER BY qtime DESC LIMIT 1;");
 
 constexpr std::string_view get_job_by_id_stmt(
     "SELECT id,command,category,qtime,stime,etime,exit_status "
     "FROM job_details WHERE id = ?;");
 
+// Array members are summarised per array instead
 constexpr std::string_view get_all_jobs_stmt(
     "SELECT id,command,category,qtime,stime,etime,exit_status "
-    "FROM job_details;");
+    "FROM job_details WHERE id NOT IN ( SELECT jobid FROM array_members );");
+
+constexpr std::string_view get_array_member_jobs_stmt(
+    "SELECT id,'[' || idx || '] ' || command,category,qtime,stime,etime,"
+    "exit_status FROM job_details JOIN array_members ON job_details.id = "
+    "array_members.jobid WHERE array_id = ? ORDER BY idx ASC;");
+
+constexpr std::string_view get_array_stats_stmt(
+    "SELECT arrays.id,arrays.command,arrays.category,first,last,step,next,"
+    "COUNT(job_details.stime) - COUNT(job_details.etime),"
+    "COUNT(job_details.etime),COUNT(NULLIF(job_details.exit_status,0)) FROM "
+    "arrays LEFT JOIN array_members ON arrays.id = array_members.array_id "
+    "LEFT JOIN job_details ON array_members.jobid = job_details.id GROUP BY "
+    "arrays.id ORDER BY arrays.id ASC;");
+
+constexpr std::string_view insert_array_stmt(
+    "INSERT INTO arrays(command,command_raw,category,slots,first,last,step,"
+    "next,cwd,environ,qtime) VALUES (?,?,?,?,?,?,?,?,?,?,?);");
+
+constexpr std::string_view insert_array_config_stmt(
+    "INSERT OR REPLACE INTO array_config(array_id,config) VALUES (?,?);");
+
+constexpr std::string_view get_pending_array_stmt(
+    "SELECT id FROM arrays WHERE next <= last ORDER BY id ASC LIMIT 1;");
+
+constexpr std::string_view get_array_to_run_stmt(
+    "SELECT command_raw,cwd,environ,COALESCE(config,'') FROM arrays LEFT "
+    "JOIN array_config ON arrays.id = array_config.array_id WHERE id = ?;");
+
+constexpr std::string_view get_next_array_index_stmt(
+    "SELECT next FROM arrays WHERE id = ? AND next <= last;");
+
+constexpr std::string_view
+    bump_array_index_stmt("UPDATE arrays SET next = next + step WHERE id = ?;");
+
+constexpr std::string_view insert_array_member_stmt(
+    "INSERT INTO array_members(jobid,array_id,idx) SELECT id,?,? FROM jobs "
+    "WHERE uuid = ?;");
+
+constexpr std::string_view get_array_member_stmt(
+    "SELECT array_id,idx FROM array_members WHERE jobid = ?;");
 
 constexpr std::string_view get_failed_jobs_stmt(
     "SELECT id,command,category,qtime,stime,etime,exit_status "
@@ -149,12 +457,35 @@ constexpr std::string_view get_job_details_by_id_stmt(
     "SELECT id,command,category,qtime,stime,etime,exit_status,uuid,slots,pid "
     "FROM job_details WHERE id = ?;");
 
+// Profiles left in the job database by older versions of memprof
 constexpr std::string_view
     has_memprof("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND "
                 "name = 'memprof'");
 
+constexpr std::string_view
+    attach_memprof_stmt("ATTACH DATABASE ? AS memprof_db;");
+
+constexpr std::string_view detach_memprof_stmt("DETACH DATABASE memprof_db;");
+
+// Older memprof databases have no profiles to offer until memprof next
+// starts and upgrades them
+constexpr std::string_view
+    get_attached_memprof_version_stmt("PRAGMA memprof_db.user_version;");
+
 constexpr std::string_view get_max_rss_stmt(
-    "SELECT jobid,MAX(rss) / 1048576.0 FROM memprof GROUP BY jobid;");
+    "SELECT jobid,max_rss / 1048576.0 FROM memprof_summary;");
+
+constexpr std::string_view get_job_usage_stmt(
+    "SELECT last_time,max_rss,max_threads,cpu_time,read_bytes,write_bytes,"
+    "vol_ctxt,invol_ctxt,max_cpu_util,max_read_rate,max_write_rate FROM "
+    "memprof_summary WHERE jobid = ?;");
+
+// Chunks are committed one at a time as the job ends, they only count as
+// its output once its etime is recorded
+constexpr std::string_view get_output_chunks_stmt(
+    "SELECT bytes,data FROM job_output_chunks JOIN jobs ON jobs.id = "
+    "job_output_chunks.jobid WHERE jobid = ? AND stream = ? AND etime IS NOT "
+    "NULL ORDER BY seq ASC;");
 
 constexpr std::string_view
     get_job_stdout_stmt("SELECT stdout FROM job_output WHERE jobid = ?;");
@@ -166,13 +497,20 @@ constexpr std::string_view
     get_cmd_to_rerun_stmt("SELECT command_raw FROM jobs WHERE id = ?;");
 
 constexpr std::string_view
-    get_state_stmt("SELECT cwd,environ FROM start_state WHERE jobid = ?;");
+    get_state_stmt("SELECT cwd,environ FROM start_state WHERE jobid = ?1 "
+                   "UNION ALL SELECT cwd,environ FROM arrays JOIN "
+                   "array_members ON arrays.id = array_members.array_id "
+                   "WHERE array_members.jobid = ?1 LIMIT 1;");
 
 constexpr std::string_view
     get_extern_jobid_stmt("SELECT id FROM jobs WHERE uuid = ?;");
 
 constexpr std::string_view get_uuid_stmt("SELECT uuid FROM jobs WHERE id = ?;");
 
+// Exit status recorded for jobs cancelled because a parent they depend on
+// with --afterok failed
+constexpr int32_t dependency_failed_status = -2;
+
 enum class ListCategory { none, all, failed, queued, running, finished };
 
 struct job_stat {
@@ -198,6 +536,53 @@ struct job_details {
   std::optional<uint32_t> pid;
 };
 
+// From memprof_summary. Totals are as at last_time, rates are the highest
+// seen between two samples.
+struct job_usage {
+  int64_t last_time;
+  uint64_t max_rss;
+  uint64_t max_threads;
+  uint64_t cpu_time;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+  uint64_t vol_ctxt;
+  uint64_t invol_ctxt;
+  std::optional<double> max_cpu_util;
+  std::optional<double> max_read_rate;
+  std::optional<double> max_write_rate;
+};
+
+struct waiting_job {
+  uint32_t id;
+  std::string uuid;
+  int32_t slots;
+  uint32_t pid;
+  std::optional<int64_t> est_time;
+  int64_t mem;
+  std::string distribution;
+  std::string smt;
+};
+
+struct running_alloc {
+  int32_t slots;
+  std::optional<int64_t> stime;
+  std::optional<int64_t> est_time;
+  int64_t mem;
+};
+
+struct array_stat {
+  uint32_t id;
+  std::string cmd;
+  std::optional<std::string> category;
+  int64_t first;
+  int64_t last;
+  int64_t step;
+  int64_t next;
+  int32_t running;
+  int32_t finished;
+  int32_t failed;
+};
+
 typedef std::pair<char **, std::string> ptr_array_w_buffer_t;
 
 struct prog_state {
@@ -205,41 +590,124 @@ struct prog_state {
   ptr_array_w_buffer_t env;
 };
 
+// Connection settings, from TSP_DB_SYNCHRONOUS and TSP_DB_JOURNAL_MODE
+std::string db_pragmas(bool rw);
+
 class Status_Manager {
 public:
   const std::string jobid;
   Status_Manager(bool rw, bool open_can_fail);
+  explicit Status_Manager(const std::string &uuid);
   Status_Manager(bool rw);
   Status_Manager();
   ~Status_Manager();
   void set_total_slots(int32_t total_slots);
   void add_cmd(Run_cmd &cmd, std::string category, int32_t slots);
   void add_cmd(Run_cmd &cmd, uint32_t id);
-  void insert_proc_allocation();
+  std::vector<uint32_t> add_cmds(std::vector<Run_cmd> &cmds,
+                                 std::string category, int32_t slots,
+                                 prog_state &ps, const std::string &config);
+  std::optional<uint32_t> claim_queued_job();
+  bool claim_queued_job(uint32_t id);
+  int64_t count_unclaimed_jobs();
+  // Queued jobs claimed by a runner that has since died go back to the
+  // queue. Returns true if a live runner is waiting to start a queued job.
+  bool release_orphaned_jobs();
+  uint32_t add_dependent_cmd(Run_cmd &cmd, std::string category,
+                             int32_t slots, prog_state &ps,
+                             const std::vector<uint32_t> &after,
+                             const std::vector<uint32_t> &afterok,
+                             const std::string &config);
+  void cancel_failed_dependents();
+  uint32_t add_array(Run_cmd &cmd, std::string category, int32_t slots,
+                     prog_state &ps, int64_t first, int64_t last, int64_t step,
+                     const std::string &config);
+  std::optional<uint32_t> get_pending_array();
+  // The command template, state and config of an array
+  std::tuple<std::string, prog_state, std::string>
+  get_array_to_run(uint32_t array_id);
+  std::optional<int64_t> claim_array_index(uint32_t array_id);
+  void add_array_member(uint32_t array_id, int64_t idx,
+                        const std::string &config);
+  std::vector<array_stat> get_array_stats();
+  std::vector<job_stat> get_array_member_stats(uint32_t array_id);
+  std::optional<std::tuple<uint32_t, int64_t>> get_array_member(uint32_t id);
+  bool job_is_eligible(uint32_t id);
+  std::vector<uint32_t> get_eligible_dependents();
+  std::string get_job_config(uint32_t id);
+  int32_t get_slots_required();
+  bool insert_proc_allocation(const std::vector<uint32_t> &slots);
   std::vector<uint32_t> recover_proc_allocation();
   void job_start();
   void job_end(int exit_stat);
-  void save_output(const std::pair<std::string, std::string> &in);
+  // Stores the contents of the job's stdout and stderr files first
+  void job_end(
+      int exit_stat,
+      const std::pair<std::filesystem::path, std::filesystem::path> &output);
+  void save_output(
+      const std::pair<std::filesystem::path, std::filesystem::path> &in);
   std::vector<pid_t> get_running_job_pids(pid_t excl);
+  std::vector<uint32_t> get_slots_in_use();
+  std::vector<waiting_job> get_waiting_jobs();
+  std::vector<running_alloc> get_running_allocations();
+  void set_est_time(const std::vector<uint32_t> &ids, int64_t est_time);
+  void set_priority(const std::vector<uint32_t> &ids, int32_t priority);
+  std::optional<int32_t> get_priority(uint32_t id);
+  void set_mem(const std::vector<uint32_t> &ids, int64_t bytes);
+  void set_placement(const std::vector<uint32_t> &ids,
+                     const std::string &distribution, const std::string &smt);
+  void set_mem_from_history(const std::vector<uint32_t> &ids);
+  std::optional<int64_t> get_mem(uint32_t id);
+  // Unlimited if no budget has been set
+  std::optional<int64_t> get_mem_budget();
+  std::string get_node_setting(const std::string &name);
+  void set_node_setting(const std::string &name, const std::string &value);
+  bool set_node_setting_when_idle(const std::string &name,
+                                  const std::string &value);
+  // Only stores value if the setting doesn't exist yet
+  void set_node_setting_default(const std::string &name,
+                                const std::string &value);
   uint32_t get_last_job_id();
   job_stat get_job_by_id(uint32_t id);
   job_details get_job_details_by_id(uint32_t id);
   std::vector<job_stat> get_job_stats_by_category(ListCategory c);
   std::map<uint32_t, double> get_max_rss();
-  std::string get_job_stdout(uint32_t id);
-  std::string get_job_stderr(uint32_t id);
+  std::optional<job_usage> get_job_usage(uint32_t id);
+  // Prints stored output after its first skip bytes. Returns false if no
+  // output has been stored for the job.
+  bool print_job_output(uint32_t id, OutputStream s, std::ostream &out,
+                        int64_t skip);
   uint32_t get_extern_jobid();
   std::string get_job_uuid(uint32_t id);
   std::string get_cmd_to_rerun(uint32_t id);
   prog_state get_state(uint32_t id);
   void store_state(prog_state);
+  void set_membind(std::string policy, std::string nodes);
+  std::optional<std::pair<std::string, std::string>> get_membind(uint32_t id);
+  void set_cgroup(const std::string &path);
+  std::optional<std::string> get_cgroup(uint32_t id);
+  // sqlite connections can't be carried across a fork, even unused ones
+  // break connections the child opens itself. Closes every open database,
+  // forks, then reopens them in the parent. The child starts with none:
+  // every manager it inherits has a null conn_, which reads reopen but
+  // writes don't, so the child must write through managers of its own.
+  static pid_t fork_without_db();
   uint64_t qtime;
   uint64_t stime;
   uint64_t etime;
 
 protected:
   sqlite3 *conn_ = nullptr;
+  Sqlite_statement_cache stmts_;
   const bool rw_;
+  bool insert_proc_allocation(const std::string &uuid,
+                              const std::vector<uint32_t> &slots);
+  // Makes the memprof tables visible on conn_. Returns false if there are
+  // no profiles yet.
+  bool attach_memprof();
+  // An attached database is locked by every write transaction on conn_,
+  // so detach it as soon as it has been read
+  void detach_memprof();
 
 private:
   int db_open_flags_;
@@ -251,7 +719,15 @@ private:
   bool finished_;
   pid_t pid_;
   std::string gen_jobid();
+  void record_end(int exit_stat);
+  void add_dependencies(uint32_t id, const std::vector<uint32_t> &parents,
+                        bool ok_only);
   void open_db();
+  void close_db();
+  static std::vector<Status_Manager *> open_managers_;
+  static int32_t schema_version(sqlite3 *conn);
+  static void init_schema(sqlite3 *conn);
   bool db_not_openable();
+  bool memprof_attached_ = false;
 };
 } // namespace tsp
\ No newline at end of file
@@ -3,10 +3,18 @@
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <fcntl.h>
 #include <format>
 #include <iostream>
 #include <map>
+#include <poll.h>
 #include <sstream>
+#include <tuple>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "functions.hpp"
 #include "output_manager.hpp"
@@ -14,24 +22,19 @@
 
 namespace tsp {
 
-void print_job_stdout(Status_Manager sm_ro, uint32_t id) {
-  auto out = sm_ro.get_job_stdout(id);
-  if (out.empty()) {
+void print_job_stdout(Status_Manager &sm_ro, uint32_t id) {
+  // Output is only stored once the job ends, until then read the file
+  if (!sm_ro.print_job_output(id, OutputStream::out, std::cout, 0)) {
     auto uuid = sm_ro.get_job_uuid(id);
     std::ifstream stream{get_tmp() / (std::string(out_file_template) + uuid)};
     std::cout << stream.rdbuf();
-  } else {
-    std::cout << out;
   }
 };
-void print_job_stderr(Status_Manager sm_ro, uint32_t id) {
-  auto out = sm_ro.get_job_stderr(id);
-  if (out.empty()) {
+void print_job_stderr(Status_Manager &sm_ro, uint32_t id) {
+  if (!sm_ro.print_job_output(id, OutputStream::err, std::cout, 0)) {
     auto uuid = sm_ro.get_job_uuid(id);
     std::ifstream stream{get_tmp() / (std::string(err_file_template) + uuid)};
     std::cout << stream.rdbuf();
-  } else {
-    std::cout << out;
   }
 };
 void format_jobs_table(std::vector<tsp::job_stat> jobs) {
@@ -43,6 +46,10 @@ void format_jobs_table(std::vector<tsp::job_stat> jobs) {
       std::string state{!info.stime ? "queued" : "running"};
       std::printf("%-5d %10s                           %s\n", info.id,
                   state.c_str(), info.cmd.c_str());
+    } else if (!info.stime) {
+      // Never started, e.g. a dependency failed
+      std::printf("%-5d  cancelled %10d                %s\n", info.id,
+                  info.status.value(), info.cmd.c_str());
     } else {
       std::printf(
           "%-5d   finished %10d%14s  %s\n", info.id, info.status.value(),
@@ -63,7 +70,7 @@ void format_jobs_gh_md(std::vector<tsp::job_stat> jobs,
         << "## Case timings\nCase | Time | Success?\n---- | ----: | ----\n";
   }
   for (auto &info : jobs) {
-    if (!info.etime) {
+    if (!info.etime || !info.stime) {
       continue;
     }
     std::string cmd;
@@ -87,7 +94,7 @@ void format_jobs_gh_md(std::vector<tsp::job_stat> jobs,
   std::sort(jobs.begin(), jobs.end(),
             [](tsp::job_stat a, tsp::job_stat b) { return a.cmd < b.cmd; });
   for (const auto &info : jobs) {
-    if (!info.etime) {
+    if (!info.etime || !info.stime) {
       continue;
     }
     std::cout << info.cmd << " | "
@@ -104,14 +111,89 @@ void format_jobs_gh_md(std::vector<tsp::job_stat> jobs,
   }
 }
 
-void print_job_detail(Status_Manager sm_ro, uint32_t id) {
+// Copy whatever has been appended to fd since the last call to stdout
+int64_t copy_new_output(int fd) {
+  char buf[65536];
+  int64_t total = 0;
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    std::cout.write(buf, len);
+    total += len;
+  }
+  std::cout.flush();
+  return total;
+}
+
+// Tail the job's output file as it is written, woken by inotify rather
+// than re-reading it. The job stores its output before removing the file,
+// so once it has ended, anything we didn't get from the file comes from
+// the stored copy. Returns the job's exit status.
+int follow_job_output(Status_Manager &sm_ro, uint32_t id) {
+  auto fn =
+      get_tmp() / (std::string(out_file_template) + sm_ro.get_job_uuid(id));
+  int64_t offset = 0;
+  auto fd = -1;
+  auto inotify_fd = -1;
+#ifdef __linux__
+  // Until the job starts there is no file to watch, so watch for it to be
+  // created instead
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  auto dir_watch = inotify_add_watch(inotify_fd, get_tmp().c_str(), IN_CREATE);
+#endif
+  for (auto check_state = true;;) {
+    if (fd == -1 && (fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC)) != -1) {
+#ifdef __linux__
+      // Removing the file when the job ends changes its link count
+      inotify_add_watch(inotify_fd, fn.c_str(), IN_MODIFY | IN_ATTRIB);
+      inotify_rm_watch(inotify_fd, dir_watch);
+#endif
+    }
+    if (fd != -1) {
+      offset += copy_new_output(fd);
+    }
+    if (check_state) {
+      if (auto info = sm_ro.get_job_details_by_id(id); info.etime) {
+        sm_ro.print_job_output(id, OutputStream::out, std::cout, offset);
+        if (fd != -1) {
+          close(fd);
+        }
+        if (inotify_fd != -1) {
+          close(inotify_fd);
+        }
+        return info.status.value_or(EXIT_FAILURE);
+      }
+    }
+    // Without inotify, or for jobs with no output file, fall back to
+    // checking once a second
+    struct pollfd pfd = {inotify_fd, POLLIN, 0};
+    check_state = poll(&pfd, inotify_fd == -1 ? 0 : 1, 1000) <= 0;
+#ifdef __linux__
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t len;
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+      for (auto ptr = buf; ptr < buf + len;) {
+        auto event = reinterpret_cast<const struct inotify_event *>(ptr);
+        if (event->mask & (IN_ATTRIB | IN_IGNORED)) {
+          check_state = true;
+        }
+        ptr += sizeof(struct inotify_event) + event->len;
+      }
+    }
+#endif
+  }
+}
+
+void print_job_detail(Status_Manager &sm_ro, uint32_t id) {
   auto info = sm_ro.get_job_details_by_id(id);
   // Expects /etc/localtime to be symlink, therefore
   // broken on Gadi
   // Finished
   std::string runtime{
       format_hh_mm_ss(info.etime.value_or(now()) - info.stime.value_or(now()))};
-  if (!info.stime) {
+  if (!info.stime && info.etime) {
+    std::cout << "Status: Cancelled with exit status " << info.status.value()
+              << "\n";
+  } else if (!info.stime) {
     std::cout << "Status: Queued\n";
   } else if (!info.etime) {
     std::cout << "Status: Running\n";
@@ -121,6 +203,24 @@ void print_job_detail(Status_Manager sm_ro, uint32_t id) {
   }
   std::cout << "Command: " << info.cmd << "\n";
   std::cout << "Slots required: " << info.slots << "\n";
+  if (auto member = sm_ro.get_array_member(id)) {
+    std::cout << "Array: A" << std::get<0>(member.value()) << " index "
+              << std::get<1>(member.value()) << "\n";
+  }
+  if (auto priority = sm_ro.get_priority(id)) {
+    std::cout << "Priority: " << priority.value() << "\n";
+  }
+  if (auto mem = sm_ro.get_mem(id)) {
+    std::cout << std::format("Memory reserved: {:.2f} GB\n",
+                             mem.value() / 1073741824.0);
+  }
+  if (auto membind = sm_ro.get_membind(id)) {
+    std::cout << "Memory binding: " << membind.value().first
+              << " (NUMA nodes " << membind.value().second << ")\n";
+  }
+  if (auto cgroup = sm_ro.get_cgroup(id)) {
+    std::cout << "Cgroup: " << cgroup.value() << "\n";
+  }
   std::chrono::system_clock::time_point qtp{
       std::chrono::microseconds{info.qtime}};
   std::chrono::system_clock::time_point stp;
@@ -158,17 +258,65 @@ void print_job_detail(Status_Manager sm_ro, uint32_t id) {
     std::cout << "Time run: " << runtime << "\n";
     std::cout << "TSP process pid: " << info.pid.value() << "\n";
   }
+  // Only there if memprof was running while the job was
+  if (auto usage = sm_ro.get_job_usage(id); usage && info.stime) {
+    const auto &u = usage.value();
+    std::cout << std::format("Peak RSS: {:.2f} GB\n", u.max_rss / 1048576.0);
+    std::cout << "CPU time: " << format_hh_mm_ss(u.cpu_time);
+    // Utilisation per slot, over the time the job had been running when
+    // last sampled
+    if (auto elapsed = u.last_time - info.stime.value(); elapsed > 0) {
+      std::cout << std::format(", {:.0f}% of {} slot(s) on average",
+                               100.0 * u.cpu_time / elapsed /
+                                   std::max(info.slots, 1),
+                               info.slots);
+    }
+    if (u.max_cpu_util) {
+      std::cout << std::format(", {:.0f}% at peak",
+                               100.0 * u.max_cpu_util.value());
+    }
+    std::cout << "\n";
+    std::cout << std::format("I/O: {:.2f} GB read, {:.2f} GB written",
+                             u.read_bytes / 1073741824.0,
+                             u.write_bytes / 1073741824.0);
+    if (u.max_read_rate && u.max_write_rate) {
+      std::cout << std::format(", peaks of {:.1f} MB/s read and {:.1f} MB/s "
+                               "written",
+                               u.max_read_rate.value() / 1048576.0,
+                               u.max_write_rate.value() / 1048576.0);
+    }
+    std::cout << "\n";
+    std::cout << "Context switches: " << u.vol_ctxt << " voluntary, "
+              << u.invol_ctxt << " involuntary\n";
+    std::cout << "Peak threads: " << u.max_threads << "\n";
+  }
   std::cout << "Internal UUID: " << info.uuid << std::endl;
 };
-void print_jobs_list(Status_Manager sm_ro, ListCategory c) {
+void format_arrays(std::vector<tsp::array_stat> arrays) {
+  if (arrays.empty()) {
+    return;
+  }
+  std::cout << "\nArray | Finished |  Running |   Failed |    Command\n";
+  std::cout << "=====================================================\n";
+  for (const auto &info : arrays) {
+    auto total = (info.last - info.first) / info.step + 1;
+    auto done = std::format("{}/{}", info.finished, total);
+    std::printf("A%-5u %9s %10d %10d    %s\n", info.id, done.c_str(),
+                info.running, info.failed, info.cmd.c_str());
+  }
+}
+void print_jobs_list(Status_Manager &sm_ro, ListCategory c) {
   format_jobs_table(sm_ro.get_job_stats_by_category(c));
+  if (c == ListCategory::all) {
+    format_arrays(sm_ro.get_array_stats());
+  }
 }
-void print_github_summary(Status_Manager sm_ro) {
+void print_github_summary(Status_Manager &sm_ro) {
   format_jobs_gh_md(sm_ro.get_job_stats_by_category(ListCategory::all),
                     sm_ro.get_max_rss());
 };
 
-void print_time(Status_Manager sm_ro, TimeCategory c, uint32_t jobid) {
+void print_time(Status_Manager &sm_ro, TimeCategory c, uint32_t jobid) {
   auto stat = sm_ro.get_job_by_id(jobid);
   switch (c) {
   case TimeCategory::none:
@@ -223,6 +371,11 @@ int do_writer(Action a, TimeCategory time_cat, ListCategory list_cat,
     }
     print_jobs_list(sm_ro, list_cat);
     break;
+  case Action::follow:
+    return follow_job_output(sm_ro, jobid.value_or(sm_ro.get_last_job_id()));
+  case Action::list_array:
+    format_jobs_table(sm_ro.get_array_member_stats(jobid.value()));
+    break;
   case Action::print_time:
     if (time_cat == TimeCategory::none) {
       die_with_err("Error! Requested time information but no valid time "
@@ -21,6 +21,8 @@ enum class Action {
   info,
   print_time,
   github_summary,
+  list_array,
+  follow,
 };
 
 int do_writer(Action a, TimeCategory time_cat, ListCategory list_cat,
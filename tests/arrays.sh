@@ -0,0 +1,65 @@
+#!/bin/sh
+# Regression checks for --array. Usage: arrays.sh TSP
+set -u
+TSP=$1
+TMPDIR=$(mktemp -d)
+export TMPDIR
+trap 'rm -rf "$TMPDIR"' EXIT
+# Two slots, whatever the host
+HWLOC_SYNTHETIC="core:2 pu:1"
+export HWLOC_SYNTHETIC
+D=$TMPDIR/marks
+mkdir "$D"
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+# Submits a job and prints its id, see dependencies.sh
+submit() {
+  rm -f "$TMPDIR/id"
+  "$TSP" "$@" >"$TMPDIR/id"
+  tries=0
+  until [ -s "$TMPDIR/id" ]; do
+    tries=$((tries + 1))
+    [ $tries -le 100 ] || fail "no job id from tsp $*"
+    sleep 0.1
+  done
+  cat "$TMPDIR/id"
+}
+
+# Waits up to $2 seconds for $1 files matching $D/$3
+wait_for_marks() {
+  tries=0
+  until [ "$(ls "$D" | grep -c "$3")" -ge "$1" ]; do
+    tries=$((tries + 1))
+    [ $tries -le $(($2 * 10)) ] || return 1
+    sleep 0.1
+  done
+}
+
+# An array submitted while its slots are busy starts one runner. Members
+# must still run side by side once the slots free up.
+blocker=$(submit -N 2 sleep 2)
+submit --array=1-4 sh -c \
+  "touch $D/run.{}; sleep 2; ls $D | grep -c '^run' >$D/seen.{}; rm $D/run.{}" \
+  >/dev/null
+wait_for_marks 4 60 '^seen' || fail "array members did not all run"
+cat "$D"/seen.* | grep -q 2 || fail "array members never ran in parallel"
+rm -f "$D"/*
+
+# A member claimed by a runner that dies before starting it goes back to
+# the queue, along with the rest of the array
+blocker=$(submit -N 2 sleep 2)
+submit --array=1-3 sh -c "echo \$TSP_ARRAY_INDEX >$D/idx.{}" >/dev/null
+sleep 0.5
+runners=$(ps -eo pid,args | grep "[-]-array=1-3" | awk '{print $1}')
+[ -n "$runners" ] || fail "no array runner to kill"
+kill -9 $runners
+wait_for_marks 3 60 '^idx' || fail "members of a dead runner were not run"
+for i in 1 2 3; do
+  [ "$(cat "$D/idx.$i")" = "$i" ] || fail "member $i has the wrong index"
+done
+
+echo "PASS"
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Regression checks for --batch. Usage: batch.sh TSP
+set -u
+TSP=$1
+TMPDIR=$(mktemp -d)
+export TMPDIR
+trap 'rm -rf "$TMPDIR"' EXIT
+# Two slots, whatever the host
+HWLOC_SYNTHETIC="core:2 pu:1"
+export HWLOC_SYNTHETIC
+D=$TMPDIR/marks
+mkdir "$D"
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+# Waits up to $2 seconds for $1 files matching $D/$3
+wait_for_marks() {
+  tries=0
+  until [ "$(ls "$D" | grep -c "$3")" -ge "$1" ]; do
+    tries=$((tries + 1))
+    [ $tries -le $(($2 * 10)) ] || return 1
+    sleep 0.1
+  done
+}
+
+# Jobs claimed by runners that die before starting them go back to the
+# queue
+"$TSP" -N 2 sleep 2 >/dev/null
+sleep 0.3
+for i in 1 2 3 4; do
+  echo "touch $D/done.$i"
+done >"$TMPDIR/jobs"
+"$TSP" --batch="$TMPDIR/jobs" >/dev/null
+sleep 0.5
+runners=$(ps -eo pid,args | grep "[-]-batch=$TMPDIR/jobs" | awk '{print $1}')
+[ -n "$runners" ] || fail "no batch runner to kill"
+kill -9 $runners
+wait_for_marks 4 60 '^done' || fail "jobs of a dead runner were not run"
+
+echo "PASS"
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Regression checks for --after and --afterok. Usage: dependencies.sh TSP
+set -u
+TSP=$1
+TMPDIR=$(mktemp -d)
+export TMPDIR
+trap 'rm -rf "$TMPDIR"' EXIT
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+# Submits a job and prints its id. The id may come from the tsp instance
+# left running in the background, which keeps stdout open, so it can't be
+# read through a pipe.
+submit() {
+  rm -f "$TMPDIR/id"
+  "$TSP" "$@" >"$TMPDIR/id"
+  tries=0
+  until [ -s "$TMPDIR/id" ]; do
+    tries=$((tries + 1))
+    [ $tries -le 100 ] || fail "no job id from tsp $*"
+    sleep 0.1
+  done
+  cat "$TMPDIR/id"
+}
+
+# Waits for job $1 to end and returns its exit status
+wait_for() {
+  timeout 60 "$TSP" --follow="$1" >/dev/null 2>&1
+}
+
+# A dependent of a successful job runs, with its own exit status
+a=$(submit true)
+b=$(submit --afterok="$a" sh -c 'exit 3')
+wait_for "$b"
+[ $? -eq 3 ] || fail "--afterok job of a successful job did not run"
+
+# --after runs whatever the parent's status
+c=$(submit false)
+d=$(submit --after="$c" true)
+wait_for "$d" || fail "--after job of a failed job did not run"
+
+# A failed parent cancels its --afterok dependents. Anything waiting on
+# a cancelled job with --after must still be started.
+e=$(submit sh -c 'sleep 1; false')
+f=$(submit --afterok="$e" true)
+g=$(submit --after="$f" true)
+h=$(submit --afterok="$g" sh -c 'exit 5')
+wait_for "$f" && fail "--afterok job of a failed job was not cancelled"
+wait_for "$g" || fail "--after job of a cancelled job did not run"
+wait_for "$h"
+[ $? -eq 5 ] || fail "chain below a cancelled job did not run"
+
+# The same when the parent has already failed at submission
+i=$(submit --afterok="$c" true)
+j=$(submit --after="$i" true)
+wait_for "$j" || fail "--after job of a job cancelled at submission did not run"
+
+echo "PASS"
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <format>
 #include <iostream>
@@ -8,6 +10,7 @@
 #include <getopt.h>
 #include <unistd.h>
 
+#include "daemon.hpp"
 #include "functions.hpp"
 #include "help.hpp"
 #include "spooler.hpp"
@@ -23,7 +26,7 @@
 
 namespace tsp {
 
-enum class TSPProgram { spooler, writer, timeout, memprof };
+enum class TSPProgram { spooler, writer, timeout, memprof, daemon };
 
 static struct option long_options[] = {
     {"no-output", no_argument, nullptr, 'n'},
@@ -44,13 +47,35 @@ static struct option long_options[] = {
     {"print-queue-time", required_argument, nullptr, 1},
     {"print-run-time", required_argument, nullptr, 2},
     {"print-total-time", required_argument, nullptr, 3},
+    {"follow", required_argument, nullptr, 4},
     {"stdout", required_argument, nullptr, 'o'},
     {"stderr", required_argument, nullptr, 'e'},
     {"rerun", required_argument, nullptr, 'r'},
     {"verbose", no_argument, nullptr, 'v'},
     {"timeout", no_argument, nullptr, 0},
+    {"daemon", no_argument, nullptr, 0},
+    {"batch", required_argument, nullptr, 0},
+    {"distribution", required_argument, nullptr, 0},
+    {"membind", required_argument, nullptr, 0},
+    {"slot-unit", required_argument, nullptr, 0},
+    {"smt", required_argument, nullptr, 0},
+    {"est-time", required_argument, nullptr, 0},
+    {"priority", required_argument, nullptr, 0},
+    {"fair-share", required_argument, nullptr, 0},
+    {"after", required_argument, nullptr, 0},
+    {"afterok", required_argument, nullptr, 0},
+    {"array", required_argument, nullptr, 0},
+    {"mem", required_argument, nullptr, 0},
+    {"mem-budget", required_argument, nullptr, 0},
+    {"max-output", required_argument, nullptr, 0},
+    {"list-array", required_argument, nullptr, 0},
     {"polling-interval", required_argument, nullptr, 'p'},
     {"idle-timeout", required_argument, nullptr, 'I'},
+    {"smaps-interval", required_argument, nullptr, 0},
+    {"memprof-threads", required_argument, nullptr, 0},
+    {"raw-keep", required_argument, nullptr, 0},
+    {"rollup-period", required_argument, nullptr, 0},
+    {"rollup-keep", required_argument, nullptr, 0},
     {"job-timeout", required_argument, nullptr, 'T'},
     {"help", no_argument, nullptr, 'h'},
     {nullptr, 0, nullptr, 0}};
@@ -68,6 +93,7 @@ int main(int argc, char *argv[]) {
 
   auto sp_conf = tsp::Spooler_config();
   auto timeout_conf = tsp::Timeout_config();
+  auto daemon_conf = tsp::Daemon_config();
 // Disable memprof on not-linux systems
 #ifdef __linux__
   auto memprof_conf = tsp::Memprof_config();
@@ -94,6 +120,7 @@ int main(int argc, char *argv[]) {
     case 'f':
       sp_conf.set_bool("do_fork", false);
       timeout_conf.set_bool("do_fork", false);
+      daemon_conf.set_bool("do_fork", false);
       memprof_conf.set_bool("do_fork", false);
       break;
     case 'N':
@@ -108,6 +135,7 @@ int main(int argc, char *argv[]) {
     case 'v':
       sp_conf.set_bool("verbose", true);
       timeout_conf.set_bool("verbose", true);
+      daemon_conf.set_bool("verbose", true);
       memprof_conf.set_bool("verbose", true);
       break;
     case 'r':
@@ -137,12 +165,23 @@ int main(int argc, char *argv[]) {
       list_cat = tsp::ListCategory::all;
       leave_options_loop = true;
       break;
-    case 'p':
-      timeout_conf.set_int("polling_interval", std::stoul(optarg));
-      memprof_conf.set_int("polling_interval", std::stoul(optarg));
+    case 'p': {
+      auto interval = std::stod(optarg);
+      if (!(interval > 0.0) || interval * 1000 > UINT32_MAX) {
+        tsp::die_with_err(
+            std::format("ERROR! Invalid polling interval: {}", optarg), -1);
+      }
+      // The timeout poller works in whole seconds, round fractions up so a
+      // sub-second interval does not become 0 and spin
+      timeout_conf.set_int("polling_interval",
+                           static_cast<uint32_t>(std::ceil(interval)));
+      memprof_conf.set_int("polling_interval_ms",
+                           std::max(static_cast<uint32_t>(interval * 1000), 1u));
       break;
+    }
     case 'I':
       timeout_conf.set_int("idle_timeout", std::stoul(optarg));
+      daemon_conf.set_int("idle_timeout", std::stoul(optarg));
       memprof_conf.set_int("idle_timeout", std::stoul(optarg));
       break;
     case 'T':
@@ -187,12 +226,18 @@ int main(int argc, char *argv[]) {
         time_cat = tsp::TimeCategory::total;
         leave_options_loop = true;
         break;
+      case 4:
+        prog = tsp::TSPProgram::writer;
+        writer_action = tsp::Action::follow;
+        leave_options_loop = true;
+        break;
       default:
         std::cout << "Unknown option: " << argv[optind - 1] << std::endl;
         std::cout << std::format(tsp::help, argv[0]) << std::endl;
         return EXIT_FAILURE;
         break;
       }
+      break;
     case 0:
       if (std::string{"db-path"} == tsp::long_options[option_index].name) {
         std::cout << (tsp::get_tmp() / tsp::db_name).string() << std::endl;
@@ -228,12 +273,89 @@ int main(int argc, char *argv[]) {
         list_cat = tsp::ListCategory::finished;
         leave_options_loop = true;
       }
+      if (std::string{"list-array"} == tsp::long_options[option_index].name) {
+        prog = tsp::TSPProgram::writer;
+        writer_action = tsp::Action::list_array;
+        jobid = std::stoul(std::string{optarg}.starts_with('A') ? optarg + 1
+                                                                : optarg);
+        leave_options_loop = true;
+      }
       if (std::string{"timeout"} == tsp::long_options[option_index].name) {
         prog = tsp::TSPProgram::timeout;
       }
+      if (std::string{"batch"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("batch", {optarg});
+      }
+      if (std::string{"distribution"} ==
+          tsp::long_options[option_index].name) {
+        sp_conf.set_string("distribution", {optarg});
+      }
+      if (std::string{"membind"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("membind", {optarg});
+      }
+      if (std::string{"slot-unit"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("slot_unit", {optarg});
+      }
+      if (std::string{"smt"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("smt", {optarg});
+      }
+      if (std::string{"priority"} == tsp::long_options[option_index].name) {
+        sp_conf.set_int("priority", std::stoi(optarg));
+      }
+      if (std::string{"fair-share"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("fair_share", {optarg});
+      }
+      if (std::string{"after"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("after", {optarg});
+      }
+      if (std::string{"afterok"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("afterok", {optarg});
+      }
+      if (std::string{"mem"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("mem", {optarg});
+      }
+      if (std::string{"mem-budget"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("mem_budget", {optarg});
+      }
+      if (std::string{"max-output"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("max_output", {optarg});
+      }
+      if (std::string{"array"} == tsp::long_options[option_index].name) {
+        sp_conf.set_string("array", {optarg});
+      }
+      if (std::string{"est-time"} == tsp::long_options[option_index].name) {
+        auto est = tsp::parse_hh_mm_ss(optarg);
+        if (!est) {
+          tsp::die_with_err(
+              std::format("ERROR! Invalid estimated run time: {}", optarg),
+              -1);
+        }
+        sp_conf.set_int("est_time", est.value() / 1000000ll);
+      }
+      if (std::string{"daemon"} == tsp::long_options[option_index].name) {
+        prog = tsp::TSPProgram::daemon;
+      }
       if (std::string{"memprof"} == tsp::long_options[option_index].name) {
         prog = tsp::TSPProgram::memprof;
       }
+      if (std::string{"smaps-interval"} ==
+          tsp::long_options[option_index].name) {
+        memprof_conf.set_int("smaps_interval", std::stoul(optarg));
+      }
+      if (std::string{"memprof-threads"} ==
+          tsp::long_options[option_index].name) {
+        memprof_conf.set_int("threads", std::stoul(optarg));
+      }
+      if (std::string{"raw-keep"} == tsp::long_options[option_index].name) {
+        memprof_conf.set_int("raw_keep", std::stoul(optarg));
+      }
+      if (std::string{"rollup-period"} ==
+          tsp::long_options[option_index].name) {
+        memprof_conf.set_int("rollup_period", std::stoul(optarg));
+      }
+      if (std::string{"rollup-keep"} == tsp::long_options[option_index].name) {
+        memprof_conf.set_int("rollup_keep", std::stoul(optarg));
+      }
       if (std::string{"nobind"} == tsp::long_options[option_index].name) {
 #ifdef __APPLE__
         sp_conf.set_bool("binding", true);
@@ -263,6 +385,12 @@ int main(int argc, char *argv[]) {
       jobid = std::stoul(optarg);
       leave_options_loop = true;
       break;
+    case 4:
+      prog = tsp::TSPProgram::writer;
+      writer_action = tsp::Action::follow;
+      jobid = std::stoul(optarg);
+      leave_options_loop = true;
+      break;
     }
     if (leave_options_loop) {
       break;
@@ -279,6 +407,9 @@ int main(int argc, char *argv[]) {
   case tsp::TSPProgram::timeout:
     return tsp::do_timeout(timeout_conf);
     break;
+  case tsp::TSPProgram::daemon:
+    return tsp::do_daemon(daemon_conf);
+    break;
   case tsp::TSPProgram::memprof:
 // Disable memprof on not-linux systems
 #ifdef __linux__